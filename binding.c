@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <bare.h>
 #include <js.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,8 +21,8 @@ typedef struct __attribute__((packed)) {
   int32_t width;            // Image width
   int32_t height;           // Image height (negative = top-down)
   uint16_t planes;          // Color planes (always 1)
-  uint16_t bpp;             // Bits per pixel (24 or 32)
-  uint32_t compression;     // Compression (0 = none)
+  uint16_t bpp;             // Bits per pixel (1, 4, 8, 16, 24 or 32)
+  uint32_t compression;     // Compression (0 = none, 3 = bitfields)
   uint32_t image_size;      // Image size (can be 0 for uncompressed)
   int32_t x_pixels_per_m;   // Horizontal resolution
   int32_t y_pixels_per_m;   // Vertical resolution
@@ -29,152 +30,4051 @@ typedef struct __attribute__((packed)) {
   uint32_t colors_important;// Important colors (0 = all)
 } bmp_dib_header_t;
 
+// DIB header - OS/2 BITMAPCOREHEADER (12 bytes)
+typedef struct __attribute__((packed)) {
+  uint32_t header_size; // Header size (12)
+  uint16_t width;       // Image width
+  uint16_t height;      // Image height (always bottom-up)
+  uint16_t planes;      // Color planes (always 1)
+  uint16_t bpp;         // Bits per pixel (1, 4, 8 or 24)
+} bmp_core_header_t;
+
+// DIB header - BITMAPV5HEADER (124 bytes)
+typedef struct __attribute__((packed)) {
+  bmp_dib_header_t info;    // BITMAPINFOHEADER fields
+  uint32_t red_mask;        // Channel masks for BI_BITFIELDS
+  uint32_t green_mask;
+  uint32_t blue_mask;
+  uint32_t alpha_mask;
+  uint32_t cs_type;         // Color space ('sRGB' = 0x73524742)
+  int32_t endpoints[9];     // CIEXYZTRIPLE (unused for sRGB)
+  uint32_t gamma_red;       // Tone response curves (unused for sRGB)
+  uint32_t gamma_green;
+  uint32_t gamma_blue;
+  uint32_t intent;          // Rendering intent (4 = LCS_GM_IMAGES)
+  uint32_t profile_data;    // Offset to ICC profile data
+  uint32_t profile_size;    // ICC profile size
+  uint32_t reserved;        // Reserved
+} bmp_v5_header_t;
+
+// ICO/CUR directory header (6 bytes)
+typedef struct __attribute__((packed)) {
+  uint16_t reserved; // Reserved (0)
+  uint16_t type;     // Resource type (1 = icon, 2 = cursor)
+  uint16_t count;    // Number of images
+} bmp_icon_dir_t;
+
+// ICO/CUR directory entry (16 bytes)
+typedef struct __attribute__((packed)) {
+  uint8_t width;       // Image width (0 = 256)
+  uint8_t height;      // Image height (0 = 256)
+  uint8_t color_count; // Palette size (0 = no palette)
+  uint8_t reserved;    // Reserved (0)
+  uint16_t planes;     // Color planes, or cursor hotspot X
+  uint16_t bpp;        // Bits per pixel, or cursor hotspot Y
+  uint32_t size;       // Image data size
+  uint32_t offset;     // Offset to image data
+} bmp_icon_dir_entry_t;
+
+// AVI main header - 'avih' chunk (56 bytes)
+typedef struct __attribute__((packed)) {
+  uint32_t micro_sec_per_frame;   // Frame duration
+  uint32_t max_bytes_per_sec;     // Maximum data rate
+  uint32_t padding_granularity;   // Data alignment (0 = none)
+  uint32_t flags;                 // Flags (0x10 = AVIF_HASINDEX)
+  uint32_t total_frames;          // Number of frames
+  uint32_t initial_frames;        // Initial frames (0)
+  uint32_t streams;               // Number of streams
+  uint32_t suggested_buffer_size; // Largest chunk size
+  uint32_t width;                 // Frame width
+  uint32_t height;                // Frame height
+  uint32_t reserved[4];           // Reserved
+} bmp_avi_main_header_t;
+
+// AVI stream header - 'strh' chunk (56 bytes)
+typedef struct __attribute__((packed)) {
+  char type[4];                   // Stream type ('vids')
+  char handler[4];                // Codec ('DIB ')
+  uint32_t flags;                 // Flags (0)
+  uint16_t priority;              // Priority (0)
+  uint16_t language;              // Language (0)
+  uint32_t initial_frames;        // Initial frames (0)
+  uint32_t scale;                 // Time scale, rate / scale = frames per second
+  uint32_t rate;                  // Time rate
+  uint32_t start;                 // Start time (0)
+  uint32_t length;                // Number of frames
+  uint32_t suggested_buffer_size; // Largest chunk size
+  int32_t quality;                // Quality (-1 = default)
+  uint32_t sample_size;           // Sample size (frame size for uncompressed video)
+  int16_t frame[4];               // Frame rectangle (left, top, right, bottom)
+} bmp_avi_stream_header_t;
+
+// ANI header - 'anih' chunk (36 bytes)
+typedef struct __attribute__((packed)) {
+  uint32_t size;       // Header size (36)
+  uint32_t frames;     // Number of frames
+  uint32_t steps;      // Number of steps
+  uint32_t width;      // Frame width (0 = read from frames)
+  uint32_t height;     // Frame height (0 = read from frames)
+  uint32_t bpp;        // Bits per pixel (0 = read from frames)
+  uint32_t planes;     // Color planes (0 = read from frames)
+  uint32_t rate;       // Frame duration in 1/60 seconds
+  uint32_t attributes; // Flags (1 = frames are ICO/CUR data)
+} bmp_ani_header_t;
+
+// RIFF containers for animated encoding
+#define BMP_CONTAINER_AVI 0
+#define BMP_CONTAINER_ANI 1
+
+// Compression methods
+#define BMP_BI_RGB            0
+#define BMP_BI_RLE8           1
+#define BMP_BI_RLE4           2
+#define BMP_BI_BITFIELDS      3
+#define BMP_BI_JPEG           4
+#define BMP_BI_PNG            5
+#define BMP_BI_ALPHABITFIELDS 6
+
+// Largest RLE image to expand, as a few bytes of codes can cover any size
+#define BMP_RLE_MAX_PIXELS ((uint64_t) 1 << 28)
+
+// Channel masks as used by BI_BITFIELDS, in R, G, B, A order
+typedef uint32_t bmp_masks_t[4];
+
+// Per-byte lookup tables that expand a masked pixel straight into RGBA. Each
+// source bit maps onto a disjoint set of destination bits, so the entries for
+// the individual bytes of a pixel can simply be OR'ed together.
+typedef struct {
+  uint32_t lut[4][256];
+} bmp_bitfields_t;
+
+static void
+bare_bmp__on_finalize(js_env_t *env, void *data, void *finalize_hint) {
+  free(data);
+}
+
+/**
+ * Expand an n-bit channel value to 8 bits by bit replication
+ */
+static inline uint8_t
+bare_bmp__expand_channel(uint32_t value, uint32_t bits) {
+  if (bits == 0) return 0;
+  if (bits >= 8) return value >> (bits - 8);
+
+  uint32_t result = 0;
+
+  for (int32_t shift = 8 - bits; shift > -(int32_t) bits; shift -= bits) {
+    result |= shift >= 0 ? value << shift : value >> -shift;
+  }
+
+  return result;
+}
+
+/**
+ * Build the per-byte lookup tables for a pixel of the given size and masks
+ * Missing alpha masks are treated as fully opaque
+ */
+static void
+bare_bmp__init_bitfields(bmp_bitfields_t *bitfields, const bmp_masks_t masks, uint32_t bytes_per_pixel) {
+  uint32_t shift[4], bits[4];
+
+  for (int c = 0; c < 4; c++) {
+    shift[c] = masks[c] ? __builtin_ctz(masks[c]) : 0;
+    bits[c] = masks[c] ? 32 - __builtin_clz(masks[c]) - shift[c] : 0;
+  }
+
+  for (uint32_t i = 0; i < bytes_per_pixel; i++) {
+    for (uint32_t v = 0; v < 256; v++) {
+      uint32_t pixel = v << (i * 8);
+      uint8_t rgba[4];
+
+      for (int c = 0; c < 4; c++) {
+        rgba[c] = bare_bmp__expand_channel((pixel & masks[c]) >> shift[c], bits[c]);
+      }
+
+      if (masks[3] == 0) rgba[3] = i == 0 ? 0xFF : 0;
+
+      memcpy(&bitfields->lut[i][v], rgba, 4);
+    }
+  }
+}
+
+// Output pixel formats for decoding
+#define BMP_FORMAT_RGBA   0 // 8-bit RGBA, sRGB encoded
+#define BMP_FORMAT_RGBA16 1 // 16-bit RGBA, linear
+#define BMP_FORMAT_FLOAT  2 // 32-bit float RGBA, linear
+#define BMP_FORMAT_GRAY   3 // 8-bit luma, sRGB encoded
+#define BMP_FORMAT_I420   4 // 8-bit planar YUV 4:2:0, limited range
+#define BMP_FORMAT_NV12   5 // 8-bit semi-planar YUV 4:2:0, limited range
+#define BMP_FORMAT_TENSOR 6 // Normalized float RGB, sRGB encoded
+#define BMP_FORMAT_RGB    7 // 8-bit RGB, sRGB encoded
+
+// Bytes per pixel, with the planar YUV and tensor formats sized separately
+static const size_t bare_bmp__format_size[] = {4, 8, 16, 1, 0, 0, 0, 3};
+
+#define bare_bmp__is_linear(format) ((format) == BMP_FORMAT_RGBA16 || (format) == BMP_FORMAT_FLOAT)
+
+// Orientation of an image as an optional transpose followed by mirroring of
+// the source axes
+typedef struct {
+  bool transpose;
+  bool mirror_x;
+  bool mirror_y;
+} bmp_orientation_t;
+
+/**
+ * Compose a clockwise rotation by 0, 90, 180 or 270 degrees followed by
+ * horizontal and vertical flips
+ */
+static inline bmp_orientation_t
+bare_bmp__orientation(int64_t rotate, bool flip_x, bool flip_y) {
+  bmp_orientation_t orientation = {
+    .transpose = rotate == 90 || rotate == 270,
+    .mirror_x = rotate == 180 || rotate == 270,
+    .mirror_y = rotate == 90 || rotate == 180,
+  };
+
+  // Flipping a transposed image mirrors the opposite source axis
+  if (orientation.transpose) {
+    orientation.mirror_x ^= flip_y;
+    orientation.mirror_y ^= flip_x;
+  } else {
+    orientation.mirror_x ^= flip_x;
+    orientation.mirror_y ^= flip_y;
+  }
+
+  return orientation;
+}
+
+#define bare_bmp__is_yuv(format) ((format) == BMP_FORMAT_I420 || (format) == BMP_FORMAT_NV12)
+
+// Luma coefficients for gray output, and the matrix of YUV output
+#define BMP_LUMA_BT601 0
+#define BMP_LUMA_BT709 1
+
+// Tensor layouts, element types and channel orders
+#define BMP_LAYOUT_CHW 0
+#define BMP_LAYOUT_HWC 1
+
+#define BMP_DTYPE_FLOAT32 0
+#define BMP_DTYPE_FLOAT16 1
+
+#define BMP_CHANNELS_RGB 0
+#define BMP_CHANNELS_BGR 1
+
+// Tensor output options. A negative crop width or tensor width selects the
+// full extent until resolved against the image.
+typedef struct {
+  int64_t layout;
+  int64_t dtype;
+  int64_t channels;
+  float mean[3];
+  float std[3];
+  int64_t crop_x;
+  int64_t crop_y;
+  int64_t crop_width;
+  int64_t crop_height;
+  int64_t width;
+  int64_t height;
+} bmp_tensor_options_t;
+
+typedef struct {
+  int64_t format;
+  bool tone_map;
+  int64_t luma;
+  bool premultiplied;
+  bool flatten;
+  uint8_t background[3];
+  bool color_key;
+  uint8_t key[3];
+  int64_t key_tolerance;
+  int64_t rotate;
+  bool flip_x;
+  bool flip_y;
+  bool has_lut;
+  uint8_t lut[3][256];
+  bool has_matrix;
+  float matrix[12];
+  bmp_tensor_options_t tensor;
+} bmp_decode_options_t;
+
+// State for writing decoded rows to the requested output format. Rows are
+// first decoded to RGBA, or linear float RGBA for 64-bit images, and then
+// converted while still in cache.
+typedef struct {
+  bmp_decode_options_t options;
+  int64_t width;
+  int64_t height;
+  uint8_t *data;
+  size_t len;
+  uint8_t *row;
+  float *row_float;
+  float white;
+  float to_linear[256];
+  uint16_t to_linear_16[256];
+  uint8_t to_srgb[4096];
+  uint32_t luma[3];
+  int32_t yuv[3][3];
+  uint16_t *chroma;
+  float *acc;
+  int64_t acc_rows;
+  float tensor_scale[3];
+  float tensor_bias[3];
+  int32_t matrix[3][4];
+  bool mirror;
+} bmp_decoder_t;
+
+static int
+bare_bmp__get_floats(js_env_t *env, js_value_t *obj, const char *name, float *values, uint32_t len) {
+  int err;
+
+  js_value_t *arr;
+
+  err = js_get_named_property(env, obj, name, &arr);
+  if (err < 0) return err;
+
+  for (uint32_t i = 0; i < len; i++) {
+    js_value_t *val;
+
+    err = js_get_element(env, arr, i, &val);
+    if (err < 0) return err;
+
+    double value;
+
+    err = js_get_value_double(env, val, &value);
+    if (err < 0) return err;
+
+    values[i] = value;
+  }
+
+  return 0;
+}
+
+static int
+bare_bmp__get_color(js_env_t *env, js_value_t *arr, uint8_t color[3]) {
+  int err;
+
+  for (uint32_t i = 0; i < 3; i++) {
+    js_value_t *val;
+
+    err = js_get_element(env, arr, i, &val);
+    if (err < 0) return err;
+
+    uint32_t value;
+
+    err = js_get_value_uint32(env, val, &value);
+    if (err < 0) return err;
+
+    color[i] = value > 255 ? 255 : value;
+  }
+
+  return 0;
+}
+
+static int
+bare_bmp__get_tensor_options(js_env_t *env, js_value_t *opts, bmp_tensor_options_t *tensor) {
+  int err;
+
+  js_value_t *val;
+  bool is_undefined;
+
+  err = js_get_named_property(env, opts, "layout", &val);
+  if (err < 0) return err;
+
+  err = js_get_value_int64(env, val, &tensor->layout);
+  if (err < 0) return err;
+
+  err = js_get_named_property(env, opts, "dtype", &val);
+  if (err < 0) return err;
+
+  err = js_get_value_int64(env, val, &tensor->dtype);
+  if (err < 0) return err;
+
+  err = js_get_named_property(env, opts, "channels", &val);
+  if (err < 0) return err;
+
+  err = js_get_value_int64(env, val, &tensor->channels);
+  if (err < 0) return err;
+
+  err = bare_bmp__get_floats(env, opts, "mean", tensor->mean, 3);
+  if (err < 0) return err;
+
+  err = bare_bmp__get_floats(env, opts, "std", tensor->std, 3);
+  if (err < 0) return err;
+
+  tensor->crop_x = 0;
+  tensor->crop_y = 0;
+  tensor->crop_width = -1;
+  tensor->crop_height = -1;
+
+  err = js_get_named_property(env, opts, "crop", &val);
+  if (err < 0) return err;
+
+  err = js_is_undefined(env, val, &is_undefined);
+  if (err < 0) return err;
+
+  if (!is_undefined) {
+    const char *names[] = {"x", "y", "width", "height"};
+    int64_t *values[] = {&tensor->crop_x, &tensor->crop_y, &tensor->crop_width, &tensor->crop_height};
+
+    for (int i = 0; i < 4; i++) {
+      js_value_t *property;
+
+      err = js_get_named_property(env, val, names[i], &property);
+      if (err < 0) return err;
+
+      err = js_get_value_int64(env, property, values[i]);
+      if (err < 0) return err;
+    }
+  }
+
+  tensor->width = -1;
+  tensor->height = -1;
+
+  err = js_get_named_property(env, opts, "resize", &val);
+  if (err < 0) return err;
+
+  err = js_is_undefined(env, val, &is_undefined);
+  if (err < 0) return err;
+
+  if (!is_undefined) {
+    js_value_t *property;
+
+    err = js_get_named_property(env, val, "width", &property);
+    if (err < 0) return err;
+
+    err = js_get_value_int64(env, property, &tensor->width);
+    if (err < 0) return err;
+
+    err = js_get_named_property(env, val, "height", &property);
+    if (err < 0) return err;
+
+    err = js_get_value_int64(env, property, &tensor->height);
+    if (err < 0) return err;
+  }
+
+  return 0;
+}
+
+/**
+ * Resolve the crop and size of tensor output against the image, throwing if
+ * they're out of bounds
+ */
+static int
+bare_bmp__resolve_tensor(js_env_t *env, bmp_tensor_options_t *tensor, int64_t width, int64_t height) {
+  int err;
+
+  if (tensor->crop_width < 0) {
+    tensor->crop_width = width;
+    tensor->crop_height = height;
+  }
+
+  if (tensor->crop_x < 0 || tensor->crop_y < 0 || tensor->crop_width <= 0 || tensor->crop_height <= 0 || tensor->crop_x + tensor->crop_width > width || tensor->crop_y + tensor->crop_height > height) {
+    err = js_throw_error(env, NULL, "Invalid crop: out of bounds");
+    assert(err == 0);
+    return -1;
+  }
+
+  if (tensor->width < 0) {
+    tensor->width = tensor->crop_width;
+    tensor->height = tensor->crop_height;
+  }
+
+  // Only downscaling is supported, each output pixel covering at least one
+  // source pixel
+  if (tensor->width <= 0 || tensor->height <= 0 || tensor->width > tensor->crop_width || tensor->height > tensor->crop_height) {
+    err = js_throw_error(env, NULL, "Invalid resize: must not exceed the crop");
+    assert(err == 0);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+bare_bmp__get_decode_options(js_env_t *env, js_value_t *opts, bmp_decode_options_t *options) {
+  int err;
+
+  js_value_t *val;
+
+  err = js_get_named_property(env, opts, "format", &val);
+  if (err < 0) return err;
+
+  err = js_get_value_int64(env, val, &options->format);
+  if (err < 0) return err;
+
+  err = js_get_named_property(env, opts, "toneMap", &val);
+  if (err < 0) return err;
+
+  err = js_get_value_bool(env, val, &options->tone_map);
+  if (err < 0) return err;
+
+  err = js_get_named_property(env, opts, "luma", &val);
+  if (err < 0) return err;
+
+  err = js_get_value_int64(env, val, &options->luma);
+  if (err < 0) return err;
+
+  err = js_get_named_property(env, opts, "premultiplied", &val);
+  if (err < 0) return err;
+
+  err = js_get_value_bool(env, val, &options->premultiplied);
+  if (err < 0) return err;
+
+  err = js_get_named_property(env, opts, "background", &val);
+  if (err < 0) return err;
+
+  bool is_undefined;
+  err = js_is_undefined(env, val, &is_undefined);
+  if (err < 0) return err;
+
+  options->flatten = !is_undefined;
+
+  if (options->flatten) {
+    err = bare_bmp__get_color(env, val, options->background);
+    if (err < 0) return err;
+  }
+
+  err = js_get_named_property(env, opts, "colorKey", &val);
+  if (err < 0) return err;
+
+  err = js_is_undefined(env, val, &is_undefined);
+  if (err < 0) return err;
+
+  options->color_key = !is_undefined;
+
+  if (options->color_key) {
+    err = bare_bmp__get_color(env, val, options->key);
+    if (err < 0) return err;
+  }
+
+  err = js_get_named_property(env, opts, "colorKeyTolerance", &val);
+  if (err < 0) return err;
+
+  err = js_get_value_int64(env, val, &options->key_tolerance);
+  if (err < 0) return err;
+
+  err = js_get_named_property(env, opts, "rotate", &val);
+  if (err < 0) return err;
+
+  err = js_get_value_int64(env, val, &options->rotate);
+  if (err < 0) return err;
+
+  err = js_get_named_property(env, opts, "flipX", &val);
+  if (err < 0) return err;
+
+  err = js_get_value_bool(env, val, &options->flip_x);
+  if (err < 0) return err;
+
+  err = js_get_named_property(env, opts, "flipY", &val);
+  if (err < 0) return err;
+
+  err = js_get_value_bool(env, val, &options->flip_y);
+  if (err < 0) return err;
+
+  err = js_get_named_property(env, opts, "lut", &val);
+  if (err < 0) return err;
+
+  err = js_is_undefined(env, val, &is_undefined);
+  if (err < 0) return err;
+
+  options->has_lut = !is_undefined;
+
+  if (options->has_lut) {
+    uint8_t *lut;
+    size_t lut_len;
+
+    err = js_get_typedarray_info(env, val, NULL, (void **) &lut, &lut_len, NULL, NULL);
+    if (err < 0) return err;
+
+    if (lut_len != sizeof(options->lut)) {
+      err = js_throw_error(env, NULL, "Invalid LUT: expected 768 entries");
+      assert(err == 0);
+      return -1;
+    }
+
+    memcpy(options->lut, lut, sizeof(options->lut));
+  }
+
+  err = js_get_named_property(env, opts, "matrix", &val);
+  if (err < 0) return err;
+
+  err = js_is_undefined(env, val, &is_undefined);
+  if (err < 0) return err;
+
+  options->has_matrix = !is_undefined;
+
+  if (options->has_matrix) {
+    err = bare_bmp__get_floats(env, opts, "matrix", options->matrix, 12);
+    if (err < 0) return err;
+  }
+
+  if (options->format != BMP_FORMAT_TENSOR) return 0;
+
+  return bare_bmp__get_tensor_options(env, opts, &options->tensor);
+}
+
+static inline float
+bare_bmp__srgb_to_linear(float c) {
+  return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static inline float
+bare_bmp__linear_to_srgb(float c) {
+  return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1 / 2.4f) - 0.055f;
+}
+
+static inline float
+bare_bmp__clamp(float c) {
+  return c < 0 ? 0 : c > 1 ? 1 : c;
+}
+
+/**
+ * Convert a float to IEEE 754 half precision, rounding to nearest even
+ */
+static inline uint16_t
+bare_bmp__float_to_half(float f) {
+  uint32_t x;
+  memcpy(&x, &f, 4);
+
+  uint16_t sign = (x >> 16) & 0x8000;
+  int32_t exponent = ((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = x & 0x7fffff;
+
+  // Infinity and NaN
+  if (((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+  // Overflow to infinity
+  if (exponent >= 31) return sign | 0x7c00;
+
+  uint32_t shift = 13;
+
+  if (exponent <= 0) {
+    // Underflow to zero
+    if (exponent < -10) return sign;
+
+    // Subnormal, shifting in the implicit leading bit
+    mantissa |= 0x800000;
+    shift = 14 - exponent;
+    exponent = 0;
+  }
+
+  uint32_t half = (exponent << 10) + (mantissa >> shift);
+  uint32_t rest = mantissa & ((1u << shift) - 1);
+  uint32_t midpoint = 1u << (shift - 1);
+
+  // Rounding may carry into the exponent, which is still correct
+  if (rest > midpoint || (rest == midpoint && (half & 1))) half++;
+
+  return sign | half;
+}
+
+/**
+ * Reverse the order of the pixels of a row
+ */
+static inline void
+bare_bmp__mirror_row(uint8_t *row, int64_t width, size_t pixel_size) {
+  uint8_t pixel[16];
+
+  for (int64_t i = 0, j = width - 1; i < j; i++, j--) {
+    memcpy(pixel, row + i * pixel_size, pixel_size);
+    memcpy(row + i * pixel_size, row + j * pixel_size, pixel_size);
+    memcpy(row + j * pixel_size, pixel, pixel_size);
+  }
+}
+
+// Side length of the square tiles that orienting copies in
+#define BMP_TILE 16
+
+static inline void
+bare_bmp__orient_tiles(const uint8_t *src, size_t src_stride, int64_t width, int64_t height, uint8_t *dst, size_t dst_stride, size_t pixel_size, bmp_orientation_t orientation) {
+  int64_t dst_width = orientation.transpose ? height : width;
+  int64_t dst_height = orientation.transpose ? width : height;
+
+  for (int64_t ty = 0; ty < dst_height; ty += BMP_TILE) {
+    int64_t y_end = ty + BMP_TILE < dst_height ? ty + BMP_TILE : dst_height;
+
+    for (int64_t tx = 0; tx < dst_width; tx += BMP_TILE) {
+      int64_t x_end = tx + BMP_TILE < dst_width ? tx + BMP_TILE : dst_width;
+
+      for (int64_t y = ty; y < y_end; y++) {
+        uint8_t *d = dst + y * dst_stride + tx * pixel_size;
+
+        for (int64_t x = tx; x < x_end; x++, d += pixel_size) {
+          int64_t sx = orientation.transpose ? y : x;
+          int64_t sy = orientation.transpose ? x : y;
+
+          if (orientation.mirror_x) sx = width - 1 - sx;
+          if (orientation.mirror_y) sy = height - 1 - sy;
+
+          memcpy(d, src + sy * src_stride + sx * pixel_size, pixel_size);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Copy an image to the given orientation. The copy goes tile by tile so that
+ * transposing touches a bounded number of cache lines of both images.
+ */
+static void
+bare_bmp__orient(const uint8_t *src, size_t src_stride, int64_t width, int64_t height, uint8_t *dst, size_t dst_stride, size_t pixel_size, bmp_orientation_t orientation) {
+  // Specialize the pixel copy for the common sizes
+  switch (pixel_size) {
+  case 1:
+    bare_bmp__orient_tiles(src, src_stride, width, height, dst, dst_stride, 1, orientation);
+    break;
+  case 3:
+    bare_bmp__orient_tiles(src, src_stride, width, height, dst, dst_stride, 3, orientation);
+    break;
+  case 4:
+    bare_bmp__orient_tiles(src, src_stride, width, height, dst, dst_stride, 4, orientation);
+    break;
+  case 8:
+    bare_bmp__orient_tiles(src, src_stride, width, height, dst, dst_stride, 8, orientation);
+    break;
+  case 16:
+    bare_bmp__orient_tiles(src, src_stride, width, height, dst, dst_stride, 16, orientation);
+    break;
+  default:
+    bare_bmp__orient_tiles(src, src_stride, width, height, dst, dst_stride, pixel_size, orientation);
+  }
+}
+
+/**
+ * Multiply the color channels of an RGBA row by alpha, rounding to nearest
+ */
+static inline void
+bare_bmp__premultiply_row(uint8_t *row, int64_t width) {
+  for (int64_t i = 0; i < width * 4; i += 4) {
+    uint32_t a = row[i + 3];
+
+    for (int c = 0; c < 3; c++) {
+      // Exact division by 255 with rounding
+      uint32_t t = row[i + c] * a + 128;
+
+      row[i + c] = (t + (t >> 8)) >> 8;
+    }
+  }
+}
+
+/**
+ * Make the pixels of an RGBA row transparent where no channel differs from the
+ * key color by more than the tolerance
+ */
+static inline void
+bare_bmp__key_row(uint8_t *row, int64_t width, const uint8_t key[3], int32_t tolerance) {
+  for (int64_t i = 0; i < width * 4; i += 4) {
+    int32_t dr = abs(row[i + 0] - key[0]);
+    int32_t dg = abs(row[i + 1] - key[1]);
+    int32_t db = abs(row[i + 2] - key[2]);
+
+    int32_t d = dr > dg ? dr : dg;
+    if (db > d) d = db;
+
+    row[i + 3] = d <= tolerance ? 0 : row[i + 3];
+  }
+}
+
+/**
+ * Apply the per channel lookup tables and then the color matrix of the decode
+ * options to an RGBA row
+ */
+static inline void
+bare_bmp__adjust_row(const bmp_decoder_t *dec, uint8_t *row, int64_t width) {
+  const bmp_decode_options_t *options = &dec->options;
+  const int32_t(*m)[4] = dec->matrix;
+
+  for (int64_t i = 0; i < width * 4; i += 4) {
+    int32_t rgb[3] = {row[i + 0], row[i + 1], row[i + 2]};
+
+    if (options->has_lut) {
+      for (int c = 0; c < 3; c++) rgb[c] = options->lut[c][rgb[c]];
+    }
+
+    if (options->has_matrix) {
+      for (int c = 0; c < 3; c++) {
+        int32_t v = m[c][0] * rgb[0] + m[c][1] * rgb[1] + m[c][2] * rgb[2] + m[c][3];
+
+        v = v < 0 ? 0 : v >> 12;
+
+        row[i + c] = v > 255 ? 255 : v;
+      }
+    } else {
+      for (int c = 0; c < 3; c++) row[i + c] = rgb[c];
+    }
+  }
+}
+
+/**
+ * Blend an RGBA row over an opaque background color, leaving it opaque
+ */
+static inline void
+bare_bmp__flatten_row(uint8_t *row, int64_t width, const uint8_t background[3]) {
+  for (int64_t i = 0; i < width * 4; i += 4) {
+    uint32_t a = row[i + 3];
+
+    for (int c = 0; c < 3; c++) {
+      // Exact division by 255 with rounding
+      uint32_t t = row[i + c] * a + background[c] * (255 - a) + 128;
+
+      row[i + c] = (t + (t >> 8)) >> 8;
+    }
+
+    row[i + 3] = 255;
+  }
+}
+
+/**
+ * Divide the color channels of a BGRA or RGBA row by alpha, rounding to
+ * nearest. Fully transparent pixels become black.
+ */
+static inline void
+bare_bmp__unpremultiply_row(uint8_t *row, int64_t width) {
+  for (int64_t i = 0; i < width * 4; i += 4) {
+    uint32_t a = row[i + 3];
+
+    if (a == 255) continue;
+
+    for (int c = 0; c < 3; c++) {
+      uint32_t v = a ? (row[i + c] * 255 + a / 2) / a : 0;
+
+      row[i + c] = v > 255 ? 255 : v;
+    }
+  }
+}
+
+static int
+bare_bmp__init_decoder(bmp_decoder_t *dec, const bmp_decode_options_t *options, int64_t width, int64_t height, bool hdr) {
+  dec->options = *options;
+  dec->width = width;
+  dec->height = height;
+  dec->row = NULL;
+  dec->row_float = NULL;
+  dec->chroma = NULL;
+  dec->acc = NULL;
+  dec->acc_rows = 0;
+  dec->mirror = false;
+  dec->white = 1;
+
+  if (bare_bmp__is_yuv(options->format)) {
+    // A full resolution luma plane followed by two chroma planes subsampled
+    // by 2 in both directions, rounding up for odd dimensions
+    dec->len = (size_t) width * height + (size_t) 2 * ((width + 1) / 2) * ((height + 1) / 2);
+  } else if (options->format == BMP_FORMAT_TENSOR) {
+    const bmp_tensor_options_t *tensor = &options->tensor;
+
+    dec->len = (size_t) tensor->width * tensor->height * 3 * (tensor->dtype == BMP_DTYPE_FLOAT16 ? 2 : 4);
+  } else {
+    dec->len = (size_t) width * height * bare_bmp__format_size[options->format];
+  }
+
+  dec->data = malloc(dec->len);
+
+  // Luma weights in 8-bit fixed point, summing to 256
+  if (options->luma == BMP_LUMA_BT709) {
+    dec->luma[0] = 54;
+    dec->luma[1] = 183;
+    dec->luma[2] = 19;
+  } else {
+    dec->luma[0] = 77;
+    dec->luma[1] = 150;
+    dec->luma[2] = 29;
+  }
+
+  // Limited range YUV matrices in 8-bit fixed point, with luma scaled to
+  // [16, 235] and chroma to [16, 240]
+  static const int32_t bt601[3][3] = {
+    {66, 129, 25},
+    {-38, -74, 112},
+    {112, -94, -18},
+  };
+
+  static const int32_t bt709[3][3] = {
+    {47, 157, 16},
+    {-26, -87, 113},
+    {112, -102, -10},
+  };
+
+  memcpy(dec->yuv, options->luma == BMP_LUMA_BT709 ? bt709 : bt601, sizeof(dec->yuv));
+
+  // Color matrix in 12-bit fixed point, with the offset scaled from [0, 1]
+  // and biased for rounding. Entries are clamped to [-64, 64] to keep the
+  // sums within 32 bits.
+  if (options->has_matrix) {
+    for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 4; j++) {
+        float v = options->matrix[i * 4 + j];
+
+        v = v < -64 ? -64 : v > 64 ? 64 : v;
+
+        dec->matrix[i][j] = lrintf(v * (j == 3 ? 255 : 1) * 4096);
+      }
+
+      dec->matrix[i][3] += 2048;
+    }
+  }
+
+  if (bare_bmp__is_yuv(options->format)) {
+    dec->chroma = malloc(((width + 1) / 2) * 3 * sizeof(uint16_t));
+  }
+
+  if (options->format == BMP_FORMAT_TENSOR) {
+    const bmp_tensor_options_t *tensor = &options->tensor;
+
+    // Per column RGB sums followed by the reciprocal of the number of source
+    // columns that are summed
+    dec->acc = malloc(tensor->width * 4 * sizeof(float));
+
+    if (dec->acc) {
+      for (int64_t x = 0, start = 0; x < tensor->width; x++) {
+        int64_t end = ((x + 1) * tensor->crop_width + tensor->width - 1) / tensor->width;
+
+        dec->acc[x * 4 + 3] = 1.0f / (end - start);
+
+        start = end;
+      }
+    }
+
+    // Normalize as (v / 255 - mean) / std
+    for (int c = 0; c < 3; c++) {
+      dec->tensor_scale[c] = 1 / (255 * tensor->std[c]);
+      dec->tensor_bias[c] = -tensor->mean[c] / tensor->std[c];
+    }
+  }
+
+  if (options->format != BMP_FORMAT_RGBA) {
+    dec->row = malloc(width * 4);
+
+    for (uint32_t i = 0; i < 256; i++) {
+      dec->to_linear[i] = bare_bmp__srgb_to_linear(i / 255.0f);
+      dec->to_linear_16[i] = dec->to_linear[i] * 65535 + 0.5f;
+    }
+  }
+
+  if (hdr) {
+    dec->row_float = malloc(width * 4 * sizeof(float));
+
+    for (uint32_t i = 0; i < 4096; i++) {
+      dec->to_srgb[i] = bare_bmp__linear_to_srgb(i / 4095.0f) * 255 + 0.5f;
+    }
+  }
+
+  if (dec->data == NULL || (options->format != BMP_FORMAT_RGBA && dec->row == NULL) || (hdr && dec->row_float == NULL) || (bare_bmp__is_yuv(options->format) && dec->chroma == NULL) || (options->format == BMP_FORMAT_TENSOR && dec->acc == NULL)) {
+    free(dec->data);
+    free(dec->row);
+    free(dec->row_float);
+    free(dec->chroma);
+    free(dec->acc);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void
+bare_bmp__destroy_decoder(bmp_decoder_t *dec) {
+  free(dec->row);
+  free(dec->row_float);
+  free(dec->chroma);
+  free(dec->acc);
+}
+
+/**
+ * Get the destination for decoding row y to RGBA, which is the output itself
+ * for RGBA output
+ */
+static inline uint8_t *
+bare_bmp__decoder_row(bmp_decoder_t *dec, int64_t y) {
+  if (dec->options.format == BMP_FORMAT_RGBA) return dec->data + y * dec->width * 4;
+
+  return dec->row;
+}
+
+/**
+ * Write a row decoded to RGBA to the output
+ */
+static void
+bare_bmp__decoder_write_row(bmp_decoder_t *dec, const uint8_t *src, int64_t y) {
+  int64_t n = dec->width * 4;
+
+  switch (dec->options.format) {
+  case BMP_FORMAT_RGBA16: {
+    uint16_t *dst = (uint16_t *) dec->data + y * n;
+
+    for (int64_t i = 0; i < n; i += 4) {
+      dst[i + 0] = dec->to_linear_16[src[i + 0]];
+      dst[i + 1] = dec->to_linear_16[src[i + 1]];
+      dst[i + 2] = dec->to_linear_16[src[i + 2]];
+      dst[i + 3] = src[i + 3] * 257;
+    }
+
+    // Premultiply in linear light
+    if (dec->options.premultiplied) {
+      for (int64_t i = 0; i < n; i += 4) {
+        uint32_t a = dst[i + 3];
+
+        for (int c = 0; c < 3; c++) dst[i + c] = (dst[i + c] * a + 32767) / 65535;
+      }
+    }
+    break;
+  }
+
+  case BMP_FORMAT_FLOAT: {
+    float *dst = (float *) dec->data + y * n;
+
+    for (int64_t i = 0; i < n; i += 4) {
+      dst[i + 0] = dec->to_linear[src[i + 0]];
+      dst[i + 1] = dec->to_linear[src[i + 1]];
+      dst[i + 2] = dec->to_linear[src[i + 2]];
+      dst[i + 3] = src[i + 3] / 255.0f;
+    }
+
+    if (dec->options.premultiplied) {
+      for (int64_t i = 0; i < n; i += 4) {
+        for (int c = 0; c < 3; c++) dst[i + c] *= dst[i + 3];
+      }
+    }
+    break;
+  }
+
+  case BMP_FORMAT_RGB: {
+    uint8_t *dst = dec->data + y * dec->width * 3;
+
+    for (int64_t i = 0, j = 0; i < n; i += 4, j += 3) {
+      dst[j + 0] = src[i + 0];
+      dst[j + 1] = src[i + 1];
+      dst[j + 2] = src[i + 2];
+    }
+    break;
+  }
+
+  case BMP_FORMAT_GRAY: {
+    uint8_t *dst = dec->data + y * dec->width;
+    uint32_t wr = dec->luma[0], wg = dec->luma[1], wb = dec->luma[2];
+
+    for (int64_t i = 0; i < n; i += 4) {
+      dst[i / 4] = (wr * src[i + 0] + wg * src[i + 1] + wb * src[i + 2] + 128) >> 8;
+    }
+    break;
+  }
+
+  case BMP_FORMAT_I420:
+  case BMP_FORMAT_NV12: {
+    const int32_t(*m)[3] = dec->yuv;
+
+    int64_t width = dec->width;
+    int64_t chroma_width = (width + 1) / 2;
+
+    uint8_t *luma = dec->data + y * width;
+
+    for (int64_t i = 0; i < n; i += 4) {
+      int32_t r = src[i + 0], g = src[i + 1], b = src[i + 2];
+
+      luma[i / 4] = ((m[0][0] * r + m[0][1] * g + m[0][2] * b + 128) >> 8) + 16;
+    }
+
+    // Accumulate the RGB sums of each 2x2 block over a pair of rows
+    uint16_t *sum = dec->chroma;
+
+    if ((y & 1) == 0) memset(sum, 0, chroma_width * 3 * sizeof(uint16_t));
+
+    for (int64_t x = 0; x < width; x++) {
+      sum[(x / 2) * 3 + 0] += src[x * 4 + 0];
+      sum[(x / 2) * 3 + 1] += src[x * 4 + 1];
+      sum[(x / 2) * 3 + 2] += src[x * 4 + 2];
+    }
+
+    if ((y & 1) == 0 && y != dec->height - 1) break;
+
+    int64_t chroma_height = (dec->height + 1) / 2;
+
+    uint8_t *u, *v;
+    int64_t step;
+
+    if (dec->options.format == BMP_FORMAT_I420) {
+      u = dec->data + width * dec->height + (y / 2) * chroma_width;
+      v = u + chroma_width * chroma_height;
+      step = 1;
+    } else {
+      u = dec->data + width * dec->height + (y / 2) * chroma_width * 2;
+      v = u + 1;
+      step = 2;
+    }
+
+    int32_t rows = (y & 1) + 1;
+
+    for (int64_t x = 0; x < chroma_width; x++) {
+      int32_t count = rows * (x * 2 + 1 < width ? 2 : 1);
+
+      int32_t r = (sum[x * 3 + 0] + count / 2) / count;
+      int32_t g = (sum[x * 3 + 1] + count / 2) / count;
+      int32_t b = (sum[x * 3 + 2] + count / 2) / count;
+
+      // Bias before shifting to keep the sums non-negative
+      u[x * step] = (m[1][0] * r + m[1][1] * g + m[1][2] * b + (128 << 8) + 128) >> 8;
+      v[x * step] = (m[2][0] * r + m[2][1] * g + m[2][2] * b + (128 << 8) + 128) >> 8;
+    }
+    break;
+  }
+
+  case BMP_FORMAT_TENSOR: {
+    const bmp_tensor_options_t *tensor = &dec->options.tensor;
+
+    int64_t width = tensor->width;
+    int64_t crop_width = tensor->crop_width;
+    int64_t crop_height = tensor->crop_height;
+
+    // Box filter the crop down to the tensor size, summing each source row
+    // into the columns of its output row
+    float *acc = dec->acc;
+
+    if (dec->acc_rows == 0) {
+      for (int64_t x = 0; x < width; x++) {
+        acc[x * 4 + 0] = acc[x * 4 + 1] = acc[x * 4 + 2] = 0;
+      }
+    }
+
+    src += tensor->crop_x * 4;
+
+    for (int64_t x = 0; x < crop_width; x++) {
+      float *sum = acc + (x * width / crop_width) * 4;
+
+      sum[0] += src[x * 4 + 0];
+      sum[1] += src[x * 4 + 1];
+      sum[2] += src[x * 4 + 2];
+    }
+
+    dec->acc_rows++;
+
+    int64_t out_y = y * tensor->height / crop_height;
+
+    if (y + 1 < crop_height && (y + 1) * tensor->height / crop_height == out_y) break;
+
+    float inv_rows = 1.0f / dec->acc_rows;
+
+    dec->acc_rows = 0;
+
+    size_t plane = (size_t) width * tensor->height;
+
+    for (int64_t x = 0; x < width; x++) {
+      const float *sum = acc + x * 4;
+
+      float weight = sum[3] * inv_rows;
+
+      for (int c = 0; c < 3; c++) {
+        float value = sum[tensor->channels == BMP_CHANNELS_BGR ? 2 - c : c] * weight * dec->tensor_scale[c] + dec->tensor_bias[c];
+
+        size_t i = tensor->layout == BMP_LAYOUT_CHW
+                     ? c * plane + (size_t) (out_y * width + x)
+                     : (size_t) ((out_y * width + x) * 3 + c);
+
+        if (tensor->dtype == BMP_DTYPE_FLOAT16) {
+          ((uint16_t *) dec->data)[i] = bare_bmp__float_to_half(value);
+        } else {
+          ((float *) dec->data)[i] = value;
+        }
+      }
+    }
+    break;
+  }
+  }
+}
+
+/**
+ * Convert a row of 64-bit BGRA pixels, s2.13 fixed point linear scRGB, to
+ * float RGBA
+ */
+static void
+bare_bmp__decode_row_64(const uint8_t *src, float *dst, int64_t width) {
+  for (int64_t x = 0; x < width; x++, src += 8, dst += 4) {
+    int16_t bgra[4];
+    memcpy(bgra, src, 8);
+
+    dst[0] = bgra[2] * (1 / 8192.0f);
+    dst[1] = bgra[1] * (1 / 8192.0f);
+    dst[2] = bgra[0] * (1 / 8192.0f);
+    dst[3] = bgra[3] * (1 / 8192.0f);
+  }
+}
+
+/**
+ * Write a row decoded to linear float RGBA to the output. 8-bit output is
+ * optionally tone mapped with an extended Reinhard curve that maps the
+ * brightest channel value of the image to white.
+ */
+static void
+bare_bmp__decoder_write_row_float(bmp_decoder_t *dec, const float *src, int64_t y) {
+  int64_t n = dec->width * 4;
+
+  switch (dec->options.format) {
+  case BMP_FORMAT_RGBA:
+  case BMP_FORMAT_RGB:
+  case BMP_FORMAT_GRAY:
+  case BMP_FORMAT_I420:
+  case BMP_FORMAT_NV12:
+  case BMP_FORMAT_TENSOR: {
+    // Formats other than RGBA go through an RGBA row
+    uint8_t *dst = dec->options.format == BMP_FORMAT_RGBA ? dec->data + y * n : dec->row;
+    float w2 = dec->white * dec->white;
+
+    for (int64_t i = 0; i < n; i += 4) {
+      for (int c = 0; c < 3; c++) {
+        float v = src[i + c];
+
+        if (dec->options.tone_map && v > 0) v = v * (1 + v / w2) / (1 + v);
+
+        dst[i + c] = dec->to_srgb[(int32_t) (bare_bmp__clamp(v) * 4095 + 0.5f)];
+      }
+
+      dst[i + 3] = bare_bmp__clamp(src[i + 3]) * 255 + 0.5f;
+    }
+
+    if (dec->options.has_lut || dec->options.has_matrix) bare_bmp__adjust_row(dec, dst, dec->width);
+
+    if (dec->options.flatten) bare_bmp__flatten_row(dst, dec->width, dec->options.background);
+
+    if (dec->options.format != BMP_FORMAT_RGBA) bare_bmp__decoder_write_row(dec, dst, y);
+    else if (dec->options.premultiplied) bare_bmp__premultiply_row(dst, dec->width);
+    break;
+  }
+
+  case BMP_FORMAT_RGBA16: {
+    uint16_t *dst = (uint16_t *) dec->data + y * n;
+    bool premultiplied = dec->options.premultiplied;
+
+    for (int64_t i = 0; i < n; i += 4) {
+      float a = bare_bmp__clamp(src[i + 3]);
+      float k = premultiplied ? a : 1;
+
+      dst[i + 0] = bare_bmp__clamp(src[i + 0]) * k * 65535 + 0.5f;
+      dst[i + 1] = bare_bmp__clamp(src[i + 1]) * k * 65535 + 0.5f;
+      dst[i + 2] = bare_bmp__clamp(src[i + 2]) * k * 65535 + 0.5f;
+      dst[i + 3] = a * 65535 + 0.5f;
+    }
+    break;
+  }
+
+  case BMP_FORMAT_FLOAT: {
+    float *dst = (float *) dec->data + y * n;
+
+    if (dec->options.premultiplied) {
+      for (int64_t i = 0; i < n; i += 4) {
+        dst[i + 0] = src[i + 0] * src[i + 3];
+        dst[i + 1] = src[i + 1] * src[i + 3];
+        dst[i + 2] = src[i + 2] * src[i + 3];
+        dst[i + 3] = src[i + 3];
+      }
+    } else {
+      memcpy(dst, src, n * sizeof(float));
+    }
+    break;
+  }
+  }
+}
+
+/**
+ * Describe an embedded JPEG or PNG stream by its position within the input
+ * buffer, leaving it to JavaScript to hand out a view without copying
+ */
+static js_value_t *
+bare_bmp__create_embedded(js_env_t *env, const char *type, int64_t width, int64_t height, size_t offset, size_t length) {
+  int err;
+
+  js_value_t *result;
+  err = js_create_object(env, &result);
+  assert(err == 0);
+
+#define V(name, value) \
+  { \
+    js_value_t *val; \
+    err = js_create_int64(env, value, &val); \
+    assert(err == 0); \
+    err = js_set_named_property(env, result, name, val); \
+    assert(err == 0); \
+  }
+
+  V("width", width)
+  V("height", height)
+  V("offset", offset)
+  V("length", length)
+#undef V
+
+  js_value_t *type_val;
+  err = js_create_string_utf8(env, (const utf8_t *) type, -1, &type_val);
+  assert(err == 0);
+  err = js_set_named_property(env, result, "embedded", type_val);
+  assert(err == 0);
+
+  return result;
+}
+
+// Layout of a validated DIB, ready to be decoded row by row
+typedef struct {
+  int32_t width;
+  int32_t height;
+  bool top_down;
+  uint16_t bpp;
+  uint32_t compression;
+  bool indexed;
+  bool bitfields;
+  bool has_alpha;
+  const uint8_t *pixels;
+  size_t len;
+  size_t row_size;
+  const uint8_t *mask;
+  size_t mask_row_size;
+  uint8_t *data; // Expanded RLE pixels, if any
+  uint32_t palette[256];
+  bmp_bitfields_t lut;
+} bmp_dib_t;
+
+/**
+ * Expand RLE8 or RLE4 pixels to one palette index per byte, bottom-up like
+ * the encoded rows. Pixels skipped by delta and end of line codes, or missing
+ * from truncated data, keep the first palette entry.
+ */
+static void
+bare_bmp__decode_rle(const uint8_t *src, size_t len, uint8_t *dst, int64_t width, int64_t height, bool rle4) {
+  int64_t x = 0, y = 0;
+  size_t i = 0;
+
+  while (i + 1 < len && y < height) {
+    uint8_t count = src[i++];
+    uint8_t value = src[i++];
+    uint8_t *row = dst + y * width;
+
+    // Encoded mode, RLE4 runs alternate between the two nibbles of the value
+    if (count > 0) {
+      for (uint32_t k = 0; k < count; k++, x++) {
+        if (x < width) row[x] = rle4 ? (k & 1 ? value & 0x0F : value >> 4) : value;
+      }
+
+      continue;
+    }
+
+    if (value == 0) {
+      // End of line
+      x = 0;
+      y++;
+    } else if (value == 1) {
+      // End of bitmap
+      break;
+    } else if (value == 2) {
+      // Delta
+      if (i + 1 >= len) break;
+
+      x += src[i++];
+      y += src[i++];
+    } else {
+      // Absolute mode, padded to a 16-bit boundary
+      size_t bytes = rle4 ? (value + 1) / 2 : value;
+
+      if (bytes > len - i) break;
+
+      for (uint32_t k = 0; k < value; k++, x++) {
+        uint8_t index = rle4 ? (k & 1 ? src[i + k / 2] & 0x0F : src[i + k / 2] >> 4) : src[i + k];
+
+        if (x < width) row[x] = index;
+      }
+
+      i += (bytes + 1) & ~(size_t) 1;
+    }
+  }
+}
+
+/**
+ * Parse a DIB, a BITMAPINFOHEADER, BITMAPCOREHEADER or OS/2 2.x header
+ * followed by its color table and pixels
+ * Handles 1/4/8-bit indexed, 24-bit BGR, 32-bit BGRA, 64-bit scRGB and 16/32-bit
+ * BI_BITFIELDS formats
+ * Supports both top-down and bottom-up orientations
+ *
+ * The pixel offset is relative to the start of the DIB, a negative offset
+ * means the pixels directly follow the color table. Icon DIBs store twice
+ * their height, the second half being a 1-bit AND mask that is applied to
+ * the alpha channel. For BI_JPEG and BI_PNG only the embedded stream is
+ * located.
+ */
+static int
+bare_bmp__parse_dib(js_env_t *env, const uint8_t *dib_data, size_t dib_len, int64_t pixel_offset, bool icon, bmp_dib_t *dib) {
+  int err;
+
+  dib->data = NULL;
+
+  // Validate minimum size
+  if (dib_len < sizeof(uint32_t)) {
+    err = js_throw_error(env, NULL, "Invalid BMP: file too small");
+    assert(err == 0);
+    return -1;
+  }
+
+  // Validate DIB header size. Besides BITMAPINFOHEADER and its V2-V5
+  // extensions, the OS/2 BITMAPCOREHEADER and OS/2 2.x headers are read into
+  // the same layout so they share the decoding below.
+  uint32_t header_size;
+  memcpy(&header_size, dib_data, sizeof(uint32_t));
+
+  bool core = header_size == sizeof(bmp_core_header_t);
+  bool os2 = header_size == 16 || header_size == 64;
+
+  if (!core && !os2 && header_size != 40 && header_size != 52 && header_size != 56 && header_size != 108 && header_size != 124) {
+    err = js_throw_error(env, NULL, "Unsupported BMP: only BITMAPINFOHEADER, BITMAPCOREHEADER and OS/2 2.x headers supported");
+    assert(err == 0);
+    return -1;
+  }
+
+  if (header_size > dib_len) {
+    err = js_throw_error(env, NULL, "Invalid BMP: file too small");
+    assert(err == 0);
+    return -1;
+  }
+
+  bmp_dib_header_t header = {0};
+
+  if (core) {
+    bmp_core_header_t *core_header = (bmp_core_header_t *) dib_data;
+
+    header.width = core_header->width;
+    header.height = core_header->height;
+    header.planes = core_header->planes;
+    header.bpp = core_header->bpp;
+  } else {
+    // Truncated OS/2 2.x headers imply zero for the omitted fields
+    memcpy(&header, dib_data, header_size < sizeof(header) ? header_size : sizeof(header));
+  }
+
+  // OS/2 2.x reuses compression 3 and 4 for Huffman and RLE24 encoding
+  if (os2 && header.compression != BMP_BI_RGB) {
+    err = js_throw_error(env, NULL, "Unsupported BMP: only uncompressed format supported");
+    assert(err == 0);
+    return -1;
+  }
+
+  // Validate compression
+  uint32_t compression = header.compression;
+
+  if (compression == BMP_BI_JPEG || compression == BMP_BI_PNG) {
+    if (pixel_offset < 0) pixel_offset = header_size;
+
+    if ((uint64_t) pixel_offset > dib_len) {
+      err = js_throw_error(env, NULL, "Invalid BMP: pixel data exceeds file size");
+      assert(err == 0);
+      return -1;
+    }
+
+    // The image size is the stream length, otherwise assume it runs to the end
+    size_t length = dib_len - pixel_offset;
+    if (header.image_size != 0 && header.image_size < length) length = header.image_size;
+
+    int32_t height = header.height;
+
+    dib->width = header.width;
+    dib->height = height < 0 ? -height : height;
+    dib->compression = compression;
+    dib->pixels = dib_data + pixel_offset;
+    dib->len = length;
+
+    return 0;
+  }
+
+  bool rle = compression == BMP_BI_RLE8 || compression == BMP_BI_RLE4;
+
+  if (!rle && compression != BMP_BI_RGB && compression != BMP_BI_BITFIELDS && compression != BMP_BI_ALPHABITFIELDS) {
+    err = js_throw_error(env, NULL, "Unsupported BMP: only uncompressed and RLE formats supported");
+    assert(err == 0);
+    return -1;
+  }
+
+  // Validate bits per pixel
+  uint16_t bpp = header.bpp;
+
+  bool indexed = bpp == 1 || bpp == 4 || bpp == 8;
+
+  if (compression == BMP_BI_RGB ? !indexed && bpp != 16 && bpp != 24 && bpp != 32 && bpp != 64 : !rle && bpp != 16 && bpp != 32) {
+    err = js_throw_error(env, NULL, "Unsupported BMP: only 1-bit, 4-bit, 8-bit, 16-bit, 24-bit, 32-bit and 64-bit formats supported");
+    assert(err == 0);
+    return -1;
+  }
+
+  if (rle && bpp != (compression == BMP_BI_RLE8 ? 8 : 4)) {
+    err = js_throw_error(env, NULL, "Invalid BMP: RLE8 requires 8-bit and RLE4 requires 4-bit pixels");
+    assert(err == 0);
+    return -1;
+  }
+
+  int32_t width = header.width;
+  int32_t height = header.height;
+
+  if (icon) height /= 2;
+
+  if (width <= 0 || height == 0 || height == INT32_MIN) {
+    err = js_throw_error(env, NULL, "Invalid BMP: invalid dimensions");
+    assert(err == 0);
+    return -1;
+  }
+
+  int32_t abs_height = height < 0 ? -height : height;
+  bool top_down = height < 0;
+  uint32_t bytes_per_pixel = bpp / 8;
+
+  // Resolve channel masks. The 16-bit BI_RGB default is 5-5-5, and masks
+  // follow the 40-byte header unless they are part of a V2+ header.
+  bmp_masks_t masks = {0x7C00, 0x03E0, 0x001F, 0};
+  bool bitfields = bpp == 16;
+  size_t masks_size = 0;
+
+  if (compression == BMP_BI_BITFIELDS || compression == BMP_BI_ALPHABITFIELDS) {
+    size_t mask_count = header_size >= 56 || compression == BMP_BI_ALPHABITFIELDS ? 4 : 3;
+
+    if (header_size == 40) masks_size = mask_count * 4;
+
+    if (header_size + masks_size > dib_len) {
+      err = js_throw_error(env, NULL, "Invalid BMP: file too small");
+      assert(err == 0);
+      return -1;
+    }
+
+    masks[3] = 0;
+    memcpy(masks, dib_data + sizeof(bmp_dib_header_t), mask_count * 4);
+
+    // Plain BGRA masks can take the byte-swizzle path below
+    bitfields = bpp == 16 || masks[0] != 0x00FF0000 || masks[1] != 0x0000FF00 || masks[2] != 0x000000FF || (masks[3] != 0xFF000000 && masks[3] != 0);
+  }
+
+  // Read the color table of indexed images, entries are BGRX or BGR for
+  // BITMAPCOREHEADER. Indices past the end of the table decode as opaque black.
+  uint32_t *palette = dib->palette;
+  size_t palette_size = 0;
+
+  if (indexed) {
+    uint32_t colors_used = header.colors_used;
+    if (colors_used == 0 || colors_used > (1u << bpp)) colors_used = 1u << bpp;
+
+    uint32_t entry_size = core ? 3 : 4;
+
+    palette_size = colors_used * entry_size;
+
+    if (header_size + palette_size > dib_len) {
+      err = js_throw_error(env, NULL, "Invalid BMP: color table exceeds file size");
+      assert(err == 0);
+      return -1;
+    }
+
+    const uint8_t *entry = dib_data + header_size;
+
+    for (uint32_t i = 0; i < 256; i++) {
+      uint8_t rgba[4] = {0, 0, 0, 0xFF};
+
+      if (i < colors_used) {
+        rgba[0] = entry[2];
+        rgba[1] = entry[1];
+        rgba[2] = entry[0];
+
+        entry += entry_size;
+      }
+
+      memcpy(&palette[i], rgba, 4);
+    }
+  } else {
+    // Other images may still carry a color table, which the pixels follow
+    palette_size = (size_t) header.colors_used * 4;
+  }
+
+  if (pixel_offset < 0) pixel_offset = header_size + masks_size + palette_size;
+
+  // Calculate row size with 4-byte padding
+  size_t row_size = (((size_t) width * bpp + 31) / 32) * 4;
+
+  // Validate data offset and size
+  if ((uint64_t) pixel_offset > dib_len || (!rle && row_size * abs_height > dib_len - pixel_offset)) {
+    err = js_throw_error(env, NULL, "Invalid BMP: pixel data exceeds file size");
+    assert(err == 0);
+    return -1;
+  }
+
+  const uint8_t *pixel_data = dib_data + pixel_offset;
+
+  // RLE rows vary in length, so expand them up front to 8-bit indices
+  if (rle) {
+    if (top_down) {
+      err = js_throw_error(env, NULL, "Invalid BMP: RLE images must be bottom-up");
+      assert(err == 0);
+      return -1;
+    }
+
+    size_t len = dib_len - pixel_offset;
+
+    // Delta and end codes skip any number of pixels, so the stream doesn't
+    // bound the image size. Cap it instead before allocating.
+    if ((uint64_t) width * abs_height > BMP_RLE_MAX_PIXELS) {
+      err = js_throw_error(env, NULL, "Unsupported BMP: RLE image too large");
+      assert(err == 0);
+      return -1;
+    }
+
+    if (header.image_size != 0 && header.image_size < len) len = header.image_size;
+
+    dib->data = calloc((size_t) width * abs_height, 1);
+
+    if (dib->data == NULL) {
+      err = js_throw_error(env, NULL, "Memory allocation failed");
+      assert(err == 0);
+      return -1;
+    }
+
+    bare_bmp__decode_rle(pixel_data, len, dib->data, width, abs_height, compression == BMP_BI_RLE4);
+
+    pixel_data = dib->data;
+    row_size = width;
+    bpp = 8;
+  }
+
+  if (bitfields) bare_bmp__init_bitfields(&dib->lut, masks, bytes_per_pixel);
+
+  // BGRA without an alpha mask is opaque
+  bool has_alpha = bpp == 32 && (compression == BMP_BI_RGB || masks[3] != 0);
+
+  // Apply the AND mask of icons without their own alpha channel. Set bits
+  // are transparent, and 32-bit icons may omit the mask altogether.
+  size_t mask_row_size = (((size_t) width + 31) / 32) * 4;
+  size_t mask_offset = pixel_offset + row_size * abs_height;
+
+  const uint8_t *mask_data = NULL;
+
+  if (icon && !has_alpha && !rle && mask_row_size * abs_height <= dib_len - mask_offset) {
+    mask_data = dib_data + mask_offset;
+  }
+
+  dib->width = width;
+  dib->height = abs_height;
+  dib->top_down = top_down;
+  dib->bpp = bpp;
+  dib->compression = compression;
+  dib->indexed = indexed;
+  dib->bitfields = bitfields;
+  dib->has_alpha = has_alpha;
+  dib->pixels = pixel_data;
+  dib->len = row_size * abs_height;
+  dib->row_size = row_size;
+  dib->mask = mask_data;
+  dib->mask_row_size = mask_row_size;
+
+  return 0;
+}
+
+static void
+bare_bmp__destroy_dib(bmp_dib_t *dib) {
+  free(dib->data);
+  free(dib);
+}
+
+/**
+ * Decode row y of a DIB, counting from the top, to RGBA, or to float RGBA for
+ * 64-bit images. The icon mask, if any, is applied to alpha.
+ */
+static void
+bare_bmp__decode_dib_pixels(const bmp_dib_t *dib, int64_t y, void *pixels) {
+  int64_t width = dib->width;
+  int64_t height = dib->height;
+  uint32_t bpp = dib->bpp;
+  uint32_t bytes_per_pixel = bpp / 8;
+
+  // BMP stores pixels bottom-up by default (unless height is negative)
+  int64_t src_row = dib->top_down ? y : (height - 1 - y);
+  const uint8_t *src = dib->pixels + src_row * dib->row_size;
+
+  if (bpp == 64) {
+    bare_bmp__decode_row_64(src, pixels, width);
+    return;
+  }
+
+  uint8_t *dst = pixels;
+  uint8_t *row = dst;
+
+  if (dib->indexed) {
+    // Pixels are packed most significant bits first
+    uint32_t mask = (1u << bpp) - 1;
+
+    for (int64_t x = 0; x < width; x++) {
+      uint32_t bit = (uint32_t) x * bpp;
+      uint32_t index = (src[bit / 8] >> (8 - bpp - bit % 8)) & mask;
+      memcpy(dst, &dib->palette[index], 4);
+
+      dst += 4;
+    }
+  } else if (dib->bitfields && bytes_per_pixel == 2) {
+    const bmp_bitfields_t *lut = &dib->lut;
+
+    for (int64_t x = 0; x < width; x++) {
+      // Expand 16-bit pixels through the low and high byte tables
+      uint32_t px = lut->lut[0][src[0]] | lut->lut[1][src[1]];
+      memcpy(dst, &px, 4);
+
+      src += 2;
+      dst += 4;
+    }
+  } else if (dib->bitfields) {
+    const bmp_bitfields_t *lut = &dib->lut;
+
+    for (int64_t x = 0; x < width; x++) {
+      uint32_t px = lut->lut[0][src[0]] | lut->lut[1][src[1]] | lut->lut[2][src[2]] | lut->lut[3][src[3]];
+      memcpy(dst, &px, 4);
+
+      src += 4;
+      dst += 4;
+    }
+  } else {
+    bool has_alpha = dib->has_alpha;
+
+    for (int64_t x = 0; x < width; x++) {
+      // BGR(A) -> RGBA conversion
+      dst[0] = src[2]; // R
+      dst[1] = src[1]; // G
+      dst[2] = src[0]; // B
+      dst[3] = has_alpha ? src[3] : 0xFF; // A
+
+      src += bytes_per_pixel;
+      dst += 4;
+    }
+  }
+
+  if (dib->mask) {
+    const uint8_t *mask = dib->mask + (height - 1 - y) * dib->mask_row_size;
+    uint8_t *alpha = row + 3;
+
+    for (int64_t x = 0; x < width; x += 8) {
+      uint8_t bits = mask[x / 8];
+
+      for (int64_t i = 0; i < 8 && x + i < width; i++, alpha += 4) {
+        // Expand each mask bit to an all-or-nothing alpha byte
+        *alpha &= ((bits << i) & 0x80) ? 0x00 : 0xFF;
+      }
+    }
+  }
+}
+
+/**
+ * Apply the per pixel options to a row decoded to RGBA and write it to row y
+ * of the output
+ */
+static void
+bare_bmp__decoder_finish_row(bmp_decoder_t *dec, uint8_t *row, int64_t y) {
+  int64_t width = dec->width;
+
+  if (dec->options.color_key) {
+    bare_bmp__key_row(row, width, dec->options.key, dec->options.key_tolerance);
+  }
+
+  // Adjustments and flattening work on sRGB encoded values, so linear output
+  // is left as is
+  bool linear = bare_bmp__is_linear(dec->options.format);
+
+  if ((dec->options.has_lut || dec->options.has_matrix) && !linear) {
+    bare_bmp__adjust_row(dec, row, width);
+  }
+
+  if (dec->options.flatten && !linear) {
+    bare_bmp__flatten_row(row, width, dec->options.background);
+  }
+
+  if (dec->options.format != BMP_FORMAT_RGBA) bare_bmp__decoder_write_row(dec, row, y);
+  else if (dec->options.premultiplied) bare_bmp__premultiply_row(row, width);
+}
+
+/**
+ * Decode row y of a DIB, counting from the top, to row dst_y of the decoder,
+ * mirrored if the decoder asks for it
+ */
+static void
+bare_bmp__decode_dib_row(const bmp_dib_t *dib, int64_t y, bmp_decoder_t *dec, int64_t dst_y) {
+  if (dib->bpp == 64) {
+    bare_bmp__decode_dib_pixels(dib, y, dec->row_float);
+
+    if (dec->mirror) bare_bmp__mirror_row((uint8_t *) dec->row_float, dib->width, 4 * sizeof(float));
+
+    bare_bmp__decoder_write_row_float(dec, dec->row_float, dst_y);
+    return;
+  }
+
+  uint8_t *row = bare_bmp__decoder_row(dec, dst_y);
+
+  bare_bmp__decode_dib_pixels(dib, y, row);
+
+  if (dec->mirror) bare_bmp__mirror_row(row, dib->width, 4);
+
+  bare_bmp__decoder_finish_row(dec, row, dst_y);
+}
+
+/**
+ * Decode a DIB to a transposed orientation. Bands of rows are decoded and
+ * copied to the oriented image while still in cache, after which rows y_start
+ * to y_start + rows of the oriented image are written to the output.
+ */
+static int
+bare_bmp__decode_dib_transposed(const bmp_dib_t *dib, bmp_decoder_t *dec, bmp_orientation_t orientation, int64_t y_start, int64_t rows) {
+  int64_t width = dib->width;
+  int64_t height = dib->height;
+
+  bool hdr = dib->bpp == 64;
+  size_t pixel_size = hdr ? 4 * sizeof(float) : 4;
+
+  // RGBA output is oriented in place, other formats through a copy
+  bool direct = !hdr && dec->options.format == BMP_FORMAT_RGBA;
+
+  size_t band_stride = width * pixel_size;
+  size_t oriented_stride = height * pixel_size;
+
+  uint8_t *band = malloc(band_stride * BMP_TILE);
+  uint8_t *oriented = direct ? dec->data : malloc(oriented_stride * width);
+
+  if (band == NULL || oriented == NULL) {
+    free(band);
+    if (!direct) free(oriented);
+    return -1;
+  }
+
+  for (int64_t y = 0; y < height; y += BMP_TILE) {
+    int64_t n = height - y < BMP_TILE ? height - y : BMP_TILE;
+
+    for (int64_t i = 0; i < n; i++) {
+      bare_bmp__decode_dib_pixels(dib, y + i, band + i * band_stride);
+    }
+
+    // The rows of the band become columns of the oriented image
+    int64_t column = orientation.mirror_y ? height - y - n : y;
+
+    bare_bmp__orient(band, band_stride, width, n, oriented + column * pixel_size, oriented_stride, pixel_size, orientation);
+  }
+
+  for (int64_t y = 0; y < rows; y++) {
+    uint8_t *row = oriented + (y_start + y) * oriented_stride;
+
+    if (hdr) bare_bmp__decoder_write_row_float(dec, (const float *) row, y);
+    else bare_bmp__decoder_finish_row(dec, row, y);
+  }
+
+  free(band);
+  if (!direct) free(oriented);
+
+  return 0;
+}
+
+/**
+ * Decode a DIB to the requested output format. BI_JPEG and BI_PNG pixels are
+ * returned as the position of the embedded stream, offset by the base of the
+ * DIB within its buffer.
+ */
+static js_value_t *
+bare_bmp__decode_dib(js_env_t *env, const uint8_t *dib_data, size_t dib_len, size_t base, int64_t pixel_offset, bool icon, const bmp_decode_options_t *options) {
+  int err;
+
+  bmp_dib_t *dib = malloc(sizeof(bmp_dib_t));
+
+  if (dib == NULL) {
+    err = js_throw_error(env, NULL, "Memory allocation failed");
+    assert(err == 0);
+    return NULL;
+  }
+
+  err = bare_bmp__parse_dib(env, dib_data, dib_len, pixel_offset, icon, dib);
+  if (err < 0) goto err;
+
+  int64_t width = dib->width;
+  int64_t height = dib->height;
+
+  if (dib->compression == BMP_BI_JPEG || dib->compression == BMP_BI_PNG) {
+    const char *type = dib->compression == BMP_BI_PNG ? "png" : "jpeg";
+    size_t offset = base + (dib->pixels - dib_data);
+
+    js_value_t *result = bare_bmp__create_embedded(env, type, width, height, offset, dib->len);
+
+    bare_bmp__destroy_dib(dib);
+
+    return result;
+  }
+
+  bmp_orientation_t orientation = bare_bmp__orientation(options->rotate, options->flip_x, options->flip_y);
+
+  // The output is the size of the oriented image
+  if (orientation.transpose) {
+    width = dib->height;
+    height = dib->width;
+  }
+
+  // Tensor output may cover a crop of the oriented image
+  bmp_decode_options_t resolved = *options;
+
+  int64_t y_start = 0;
+  int64_t rows = height;
+
+  if (options->format == BMP_FORMAT_TENSOR) {
+    err = bare_bmp__resolve_tensor(env, &resolved.tensor, width, height);
+    if (err < 0) goto err;
+
+    options = &resolved;
+
+    y_start = resolved.tensor.crop_y;
+    rows = resolved.tensor.crop_height;
+  }
+
+  // Allocate output buffer
+  bmp_decoder_t *dec = malloc(sizeof(bmp_decoder_t));
+
+  if (dec == NULL || bare_bmp__init_decoder(dec, options, width, height, dib->bpp == 64) < 0) {
+    free(dec);
+
+    err = js_throw_error(env, NULL, "Memory allocation failed");
+    assert(err == 0);
+    goto err;
+  }
+
+  // Tone mapping maps the brightest channel value to white
+  if (dib->bpp == 64 && options->tone_map) {
+    for (int64_t y = 0; y < dib->height; y++) {
+      const uint8_t *src = dib->pixels + y * dib->row_size;
+
+      for (int64_t x = 0; x < dib->width; x++, src += 8) {
+        int16_t bgr[3];
+        memcpy(bgr, src, 6);
+
+        for (int c = 0; c < 3; c++) {
+          if (bgr[c] / 8192.0f > dec->white) dec->white = bgr[c] / 8192.0f;
+        }
+      }
+    }
+  }
+
+  if (orientation.transpose) {
+    err = bare_bmp__decode_dib_transposed(dib, dec, orientation, y_start, rows);
+
+    if (err < 0) {
+      bare_bmp__destroy_decoder(dec);
+      free(dec->data);
+      free(dec);
+
+      err = js_throw_error(env, NULL, "Memory allocation failed");
+      assert(err == 0);
+      goto err;
+    }
+  } else {
+    dec->mirror = orientation.mirror_x;
+
+    for (int64_t y = y_start; y < y_start + rows; y++) {
+      bare_bmp__decode_dib_row(dib, orientation.mirror_y ? height - 1 - y : y, dec, y - y_start);
+    }
+  }
+
+  bare_bmp__destroy_decoder(dec);
+
+  if (options->format == BMP_FORMAT_TENSOR) {
+    width = resolved.tensor.width;
+    height = resolved.tensor.height;
+  }
+
+  bare_bmp__destroy_dib(dib);
+
+  // Create result object
+  js_value_t *result;
+  err = js_create_object(env, &result);
+  assert(err == 0);
+
+  // Set width property
+  js_value_t *width_val;
+  err = js_create_int64(env, width, &width_val);
+  assert(err == 0);
+  err = js_set_named_property(env, result, "width", width_val);
+  assert(err == 0);
+
+  // Set height property
+  js_value_t *height_val;
+  err = js_create_int64(env, height, &height_val);
+  assert(err == 0);
+  err = js_set_named_property(env, result, "height", height_val);
+  assert(err == 0);
+
+  // Set data property (external ArrayBuffer with finalizer)
+  js_value_t *buffer;
+  err = js_create_external_arraybuffer(env, dec->data, dec->len, bare_bmp__on_finalize, NULL, &buffer);
+  assert(err == 0);
+  err = js_set_named_property(env, result, "data", buffer);
+  assert(err == 0);
+
+  free(dec);
+
+  return result;
+
+err:
+  bare_bmp__destroy_dib(dib);
+
+  return NULL;
+}
+
+/**
+ * Validate the file header of a BMP buffer
+ */
+static int
+bare_bmp__check_file(js_env_t *env, const uint8_t *bmp_data, size_t bmp_len) {
+  int err;
+
+  // Validate minimum size
+  if (bmp_len < sizeof(bmp_file_header_t) + sizeof(bmp_core_header_t)) {
+    err = js_throw_error(env, NULL, "Invalid BMP: file too small");
+    assert(err == 0);
+    return -1;
+  }
+
+  // Parse file header
+  const bmp_file_header_t *file_header = (const bmp_file_header_t *) bmp_data;
+
+  // Validate magic number
+  if (file_header->magic != 0x4D42) {
+    err = js_throw_error(env, NULL, "Invalid BMP: wrong magic number");
+    assert(err == 0);
+    return -1;
+  }
+
+  // Validate data offset
+  if (file_header->data_offset < sizeof(bmp_file_header_t)) {
+    err = js_throw_error(env, NULL, "Invalid BMP: pixel data exceeds file size");
+    assert(err == 0);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Decode BMP buffer to RGBA format
+ */
+static js_value_t *
+bare_bmp_decode(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 2;
+  js_value_t *argv[2];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 2);
+
+  bmp_decode_options_t options;
+  err = bare_bmp__get_decode_options(env, argv[1], &options);
+  if (err < 0) return NULL;
+
+  uint8_t *bmp_data;
+  size_t bmp_len;
+  err = js_get_typedarray_info(env, argv[0], NULL, (void **) &bmp_data, &bmp_len, NULL, NULL);
+  assert(err == 0);
+
+  err = bare_bmp__check_file(env, bmp_data, bmp_len);
+  if (err < 0) return NULL;
+
+  bmp_file_header_t *file_header = (bmp_file_header_t *) bmp_data;
+
+  return bare_bmp__decode_dib(env, bmp_data + sizeof(bmp_file_header_t), bmp_len - sizeof(bmp_file_header_t), sizeof(bmp_file_header_t), file_header->data_offset - sizeof(bmp_file_header_t), false, &options);
+}
+
+/**
+ * Decode a headerless DIB, such as a CF_DIB clipboard payload, to RGBA format
+ * The DIB starts at the given byte offset and its pixels directly follow the
+ * color table
+ */
+static js_value_t *
+bare_bmp_decode_dib(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 3;
+  js_value_t *argv[3];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 3);
+
+  uint8_t *dib_data;
+  size_t dib_len;
+  err = js_get_typedarray_info(env, argv[0], NULL, (void **) &dib_data, &dib_len, NULL, NULL);
+  assert(err == 0);
+
+  int64_t offset;
+  err = js_get_value_int64(env, argv[1], &offset);
+  assert(err == 0);
+
+  bmp_decode_options_t options;
+  err = bare_bmp__get_decode_options(env, argv[2], &options);
+  if (err < 0) return NULL;
+
+  if (offset < 0 || (uint64_t) offset > dib_len) {
+    err = js_throw_error(env, NULL, "Invalid BMP: offset exceeds buffer size");
+    assert(err == 0);
+    return NULL;
+  }
+
+  return bare_bmp__decode_dib(env, dib_data + offset, dib_len - offset, offset, -1, false, &options);
+}
+
+/**
+ * Decode the entry of an ICO/CUR buffer closest to the requested size
+ * Only the directory and the selected image are read, a size of 0 selects
+ * the largest entry. PNG entries are returned as embedded streams.
+ */
+static js_value_t *
+bare_bmp_decode_icon(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 3;
+  js_value_t *argv[3];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 3);
+
+  uint8_t *ico_data;
+  size_t ico_len;
+  err = js_get_typedarray_info(env, argv[0], NULL, (void **) &ico_data, &ico_len, NULL, NULL);
+  assert(err == 0);
+
+  int64_t size;
+  err = js_get_value_int64(env, argv[1], &size);
+  assert(err == 0);
+
+  bmp_decode_options_t options;
+  err = bare_bmp__get_decode_options(env, argv[2], &options);
+  if (err < 0) return NULL;
+
+  // Validate directory
+  if (ico_len < sizeof(bmp_icon_dir_t)) {
+    err = js_throw_error(env, NULL, "Invalid ICO: file too small");
+    assert(err == 0);
+    return NULL;
+  }
+
+  bmp_icon_dir_t *dir = (bmp_icon_dir_t *) ico_data;
+
+  if (dir->reserved != 0 || (dir->type != 1 && dir->type != 2)) {
+    err = js_throw_error(env, NULL, "Invalid ICO: wrong magic number");
+    assert(err == 0);
+    return NULL;
+  }
+
+  if (dir->count == 0 || sizeof(bmp_icon_dir_t) + dir->count * sizeof(bmp_icon_dir_entry_t) > ico_len) {
+    err = js_throw_error(env, NULL, "Invalid ICO: directory exceeds file size");
+    assert(err == 0);
+    return NULL;
+  }
+
+  bmp_icon_dir_entry_t *entries = (bmp_icon_dir_entry_t *) (ico_data + sizeof(bmp_icon_dir_t));
+  bmp_icon_dir_entry_t *best = NULL;
+  int64_t best_distance = INT64_MAX;
+  uint32_t best_width = 0, best_bpp = 0;
+
+  // Pick the closest size, preferring larger and then deeper images on ties.
+  // Cursors store their hotspot in place of the bit depth.
+  for (uint16_t i = 0; i < dir->count; i++) {
+    bmp_icon_dir_entry_t *entry = &entries[i];
+
+    uint32_t width = entry->width == 0 ? 256 : entry->width;
+    uint32_t bpp = dir->type == 1 ? entry->bpp : 0;
+    int64_t distance = size > 0 ? llabs(size - (int64_t) width) : 256 - (int64_t) width;
+
+    if (distance < best_distance || (distance == best_distance && (width > best_width || (width == best_width && bpp > best_bpp)))) {
+      best = entry;
+      best_distance = distance;
+      best_width = width;
+      best_bpp = bpp;
+    }
+  }
+
+  if (best->offset > ico_len || best->size > ico_len - best->offset) {
+    err = js_throw_error(env, NULL, "Invalid ICO: image data exceeds file size");
+    assert(err == 0);
+    return NULL;
+  }
+
+  const uint8_t *image_data = ico_data + best->offset;
+
+  // Entries may also be complete PNG files
+  if (best->size >= 4 && memcmp(image_data, "\x89PNG", 4) == 0) {
+    return bare_bmp__create_embedded(env, "png", best_width, best->height == 0 ? 256 : best->height, best->offset, best->size);
+  }
+
+  return bare_bmp__decode_dib(env, image_data, best->size, best->offset, -1, true, &options);
+}
+
+// Dithering methods for reduced bit depth encoding
+#define BMP_DITHER_NONE            0
+#define BMP_DITHER_ORDERED         1
+#define BMP_DITHER_FLOYD_STEINBERG 2
+#define BMP_DITHER_ATKINSON        3
+
+// Palette sources for indexed encoding
+#define BMP_PALETTE_AUTO 0
+#define BMP_PALETTE_MONO 1
+
+// 8x8 Bayer threshold matrix
+static const uint8_t bare_bmp__bayer[8][8] = {
+  {0, 32, 8, 40, 2, 34, 10, 42},
+  {48, 16, 56, 24, 50, 18, 58, 26},
+  {12, 44, 4, 36, 14, 46, 6, 38},
+  {60, 28, 52, 20, 62, 30, 54, 22},
+  {3, 35, 11, 43, 1, 33, 9, 41},
+  {51, 19, 59, 27, 49, 17, 57, 25},
+  {15, 47, 7, 39, 13, 45, 5, 37},
+  {63, 31, 55, 23, 61, 29, 53, 21},
+};
+
+// State for encoding 16-bit rows
+typedef struct {
+  uint32_t bits[3];   // Channel widths, in R, G, B order
+  uint32_t shift[3];  // Channel positions within the pixel
+  uint8_t levels[3][64]; // Quantized level -> expanded 8-bit value
+  int dither;
+  int16_t *error;     // Two rows of R, G, B diffusion error
+  int64_t width;
+} bmp_encoder_16_t;
+
+// RGBA input image, rows may be strided such as for a region of a larger image
+typedef struct {
+  int64_t width;
+  int64_t height;
+  size_t stride;
+  uint8_t *data;
+} bmp_image_t;
+
+/**
+ * Read and validate an image object {width, height, data, stride, offset}
+ * with pixels of the given size, RGBA unless converted from another format
+ * The stride and byte offset of the first pixel within data are optional
+ */
+static int
+bare_bmp__get_image(js_env_t *env, js_value_t *rgba_obj, uint32_t bytes_per_pixel, bmp_image_t *image) {
+  int err;
+
+  // Get width
+  js_value_t *width_val;
+  err = js_get_named_property(env, rgba_obj, "width", &width_val);
+  assert(err == 0);
+  int64_t width;
+  err = js_get_value_int64(env, width_val, &width);
+  assert(err == 0);
+
+  // Get height
+  js_value_t *height_val;
+  err = js_get_named_property(env, rgba_obj, "height", &height_val);
+  assert(err == 0);
+  int64_t height;
+  err = js_get_value_int64(env, height_val, &height);
+  assert(err == 0);
+
+  // Get data
+  js_value_t *data_val;
+  err = js_get_named_property(env, rgba_obj, "data", &data_val);
+  assert(err == 0);
+  uint8_t *rgba_data;
+  size_t rgba_len;
+  err = js_get_typedarray_info(env, data_val, NULL, (void **) &rgba_data, &rgba_len, NULL, NULL);
+  assert(err == 0);
+
+  // Validate input
+  if (width <= 0 || height <= 0 || width > INT32_MAX || height > INT32_MAX) {
+    err = js_throw_error(env, NULL, "Invalid RGBA: invalid dimensions");
+    assert(err == 0);
+    return -1;
+  }
+
+  // Get stride and offset, defaulting to tightly packed rows
+  int64_t stride = width * bytes_per_pixel;
+  int64_t offset = 0;
+
+  js_value_t *val;
+  bool is_undefined;
+
+  err = js_get_named_property(env, rgba_obj, "stride", &val);
+  assert(err == 0);
+  err = js_is_undefined(env, val, &is_undefined);
+  assert(err == 0);
+
+  if (!is_undefined) {
+    err = js_get_value_int64(env, val, &stride);
+    assert(err == 0);
+  }
+
+  err = js_get_named_property(env, rgba_obj, "offset", &val);
+  assert(err == 0);
+  err = js_is_undefined(env, val, &is_undefined);
+  assert(err == 0);
+
+  if (!is_undefined) {
+    err = js_get_value_int64(env, val, &offset);
+    assert(err == 0);
+  }
+
+  if (stride < width * bytes_per_pixel || offset < 0) {
+    err = js_throw_error(env, NULL, "Invalid RGBA: invalid stride or offset");
+    assert(err == 0);
+    return -1;
+  }
+
+  // The last row only needs to hold its own pixels. Bound the stride by
+  // dividing, as multiplying a huge stride would overflow.
+  size_t row_bytes = width * bytes_per_pixel;
+
+  if ((uint64_t) offset > rgba_len || rgba_len - offset < row_bytes || (height > 1 && (uint64_t) stride > (rgba_len - offset - row_bytes) / (height - 1))) {
+    err = js_throw_error(env, NULL, "Invalid RGBA: data buffer too small");
+    assert(err == 0);
+    return -1;
+  }
+
+  image->width = width;
+  image->height = height;
+  image->stride = stride;
+  image->data = rgba_data + offset;
+
+  return 0;
+}
+
+static int
+bare_bmp__get_option(js_env_t *env, js_value_t *opts, const char *name, int64_t *result) {
+  int err;
+
+  js_value_t *val;
+  err = js_get_named_property(env, opts, name, &val);
+  if (err < 0) return err;
+
+  return js_get_value_int64(env, val, result);
+}
+
+static int
+bare_bmp__init_encoder_16(bmp_encoder_16_t *enc, int64_t width, bool rgb565, int dither) {
+  enc->bits[0] = 5;
+  enc->bits[1] = rgb565 ? 6 : 5;
+  enc->bits[2] = 5;
+  enc->shift[0] = rgb565 ? 11 : 10;
+  enc->shift[1] = 5;
+  enc->shift[2] = 0;
+
+  for (int c = 0; c < 3; c++) {
+    for (uint32_t i = 0; i < (1u << enc->bits[c]); i++) {
+      enc->levels[c][i] = bare_bmp__expand_channel(i, enc->bits[c]);
+    }
+  }
+
+  enc->dither = dither;
+  enc->width = width;
+  enc->error = NULL;
+
+  if (dither == BMP_DITHER_FLOYD_STEINBERG) {
+    enc->error = calloc((width + 2) * 3 * 2, sizeof(int16_t));
+    if (enc->error == NULL) return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Pack a row of RGBA pixels to 16-bit RGB555/RGB565
+ */
+static void
+bare_bmp__encode_row_16(bmp_encoder_16_t *enc, const uint8_t *src, uint8_t *dst, int64_t y) {
+  int64_t width = enc->width;
+  const uint32_t *bits = enc->bits, *shift = enc->shift;
+
+  if (enc->dither == BMP_DITHER_NONE) {
+    // Truncating keeps bit-replicated values stable across round-trips
+    for (int64_t x = 0; x < width; x++) {
+      uint16_t px = (src[0] >> (8 - bits[0])) << shift[0] | (src[1] >> (8 - bits[1])) << shift[1] | (src[2] >> (8 - bits[2])) << shift[2];
+
+      dst[0] = px & 0xFF;
+      dst[1] = px >> 8;
+
+      src += 4;
+      dst += 2;
+    }
+  } else if (enc->dither == BMP_DITHER_ORDERED) {
+    const uint8_t *bayer = bare_bmp__bayer[y & 7];
+
+    for (int64_t x = 0; x < width; x++) {
+      // Offset within (0, 255) so each level is hit in proportion to the input
+      uint32_t t = (bayer[x & 7] * 2 + 1) * 255 / 128;
+      uint16_t px = 0;
+
+      for (int c = 0; c < 3; c++) {
+        uint32_t max = (1 << bits[c]) - 1;
+        px |= ((src[c] * max + t) / 255) << shift[c];
+      }
+
+      dst[0] = px & 0xFF;
+      dst[1] = px >> 8;
+
+      src += 4;
+      dst += 2;
+    }
+  } else {
+    // Row-streaming Floyd-Steinberg with a current and next error row
+    int16_t *cur = enc->error + ((y & 1) ? (width + 2) * 3 : 0) + 3;
+    int16_t *next = enc->error + ((y & 1) ? 0 : (width + 2) * 3) + 3;
+
+    memset(next - 3, 0, (width + 2) * 3 * sizeof(int16_t));
+
+    for (int64_t x = 0; x < width; x++) {
+      uint16_t px = 0;
+
+      for (int c = 0; c < 3; c++) {
+        int32_t v = src[c] + (cur[x * 3 + c] + 8) / 16;
+        if (v < 0) v = 0;
+        if (v > 255) v = 255;
+
+        uint32_t max = (1 << bits[c]) - 1;
+        uint32_t q = (v * max + 127) / 255;
+        int32_t e = v - enc->levels[c][q];
+
+        cur[(x + 1) * 3 + c] += e * 7;
+        next[(x - 1) * 3 + c] += e * 3;
+        next[x * 3 + c] += e * 5;
+        next[(x + 1) * 3 + c] += e;
+
+        px |= q << shift[c];
+      }
+
+      dst[0] = px & 0xFF;
+      dst[1] = px >> 8;
+
+      src += 4;
+      dst += 2;
+    }
+  }
+}
+
+// Color table for indexed output. Images with few enough colors map exactly
+// through a small hash table, others are quantized through an inverse lookup
+// table over 5-bit per channel buckets.
+typedef struct {
+  uint32_t len;
+  uint8_t rgb[256][3];
+  bool exact;
+  uint32_t keys[512]; // Packed RGB + 1, 0 = empty slot
+  uint8_t values[512];
+  uint8_t *inverse;
+} bmp_palette_t;
+
+typedef struct {
+  uint16_t color; // 5-bit per channel bucket
+  uint8_t key;    // Sort key, the channel being split on
+  uint32_t count;
+} bmp_palette_bin_t;
+
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+  uint64_t count;
+  uint8_t min[3];
+  uint8_t max[3];
+} bmp_palette_box_t;
+
+static inline uint32_t
+bare_bmp__palette_slot(uint32_t key) {
+  return (key * 2654435761u) >> 23;
+}
+
+static inline uint8_t
+bare_bmp__palette_index(const bmp_palette_t *palette, const uint8_t *rgba) {
+  if (palette->exact) {
+    uint32_t key = (rgba[0] << 16 | rgba[1] << 8 | rgba[2]) + 1;
+    uint32_t slot = bare_bmp__palette_slot(key);
+
+    while (palette->keys[slot] != key) slot = (slot + 1) & 511;
+
+    return palette->values[slot];
+  }
+
+  return palette->inverse[(rgba[0] >> 3) << 10 | (rgba[1] >> 3) << 5 | (rgba[2] >> 3)];
+}
+
+/**
+ * Collect the colors of an image if there are at most `max` of them
+ */
+static bool
+bare_bmp__palette_exact(bmp_palette_t *palette, const uint8_t *rgba, int64_t width, int64_t height, size_t stride, uint32_t max) {
+  memset(palette->keys, 0, sizeof(palette->keys));
+
+  palette->len = 0;
+  palette->exact = true;
+  palette->inverse = NULL;
+
+  uint32_t last = 0;
+
+  for (int64_t y = 0; y < height; y++) {
+    const uint8_t *px = rgba + y * stride;
+
+    for (int64_t x = 0; x < width; x++, px += 4) {
+      uint32_t key = (px[0] << 16 | px[1] << 8 | px[2]) + 1;
+
+      // Runs of the same color are the common case for UI assets
+      if (key == last) continue;
+      last = key;
+
+      uint32_t slot = bare_bmp__palette_slot(key);
+
+      while (palette->keys[slot] != 0 && palette->keys[slot] != key) slot = (slot + 1) & 511;
+
+      if (palette->keys[slot] == key) continue;
+
+      if (palette->len == max) return false;
+
+      palette->keys[slot] = key;
+      palette->values[slot] = palette->len;
+      palette->rgb[palette->len][0] = px[0];
+      palette->rgb[palette->len][1] = px[1];
+      palette->rgb[palette->len][2] = px[2];
+      palette->len++;
+    }
+  }
+
+  return true;
+}
+
+static int
+bare_bmp__compare_bins(const void *a, const void *b) {
+  return ((const bmp_palette_bin_t *) a)->key - ((const bmp_palette_bin_t *) b)->key;
+}
+
+static inline void
+bare_bmp__bin_rgb(uint16_t color, uint8_t rgb[3]) {
+  rgb[0] = bare_bmp__expand_channel(color >> 10, 5);
+  rgb[1] = bare_bmp__expand_channel((color >> 5) & 31, 5);
+  rgb[2] = bare_bmp__expand_channel(color & 31, 5);
+}
+
+static void
+bare_bmp__shrink_box(bmp_palette_box_t *box, const bmp_palette_bin_t *bins) {
+  box->count = 0;
+
+  for (int c = 0; c < 3; c++) {
+    box->min[c] = 31;
+    box->max[c] = 0;
+  }
+
+  for (uint32_t i = box->start; i < box->end; i++) {
+    uint8_t v[3] = {bins[i].color >> 10, (bins[i].color >> 5) & 31, bins[i].color & 31};
+
+    for (int c = 0; c < 3; c++) {
+      if (v[c] < box->min[c]) box->min[c] = v[c];
+      if (v[c] > box->max[c]) box->max[c] = v[c];
+    }
+
+    box->count += bins[i].count;
+  }
+}
+
+static uint8_t
+bare_bmp__nearest_color(const bmp_palette_t *palette, const uint8_t rgb[3]) {
+  uint32_t best = 0, best_distance = UINT32_MAX;
+
+  for (uint32_t i = 0; i < palette->len; i++) {
+    int32_t dr = rgb[0] - palette->rgb[i][0];
+    int32_t dg = rgb[1] - palette->rgb[i][1];
+    int32_t db = rgb[2] - palette->rgb[i][2];
+
+    uint32_t distance = dr * dr + dg * dg + db * db;
+
+    if (distance < best_distance) {
+      best = i;
+      best_distance = distance;
+    }
+  }
+
+  return best;
+}
+
+/**
+ * Build a palette of at most `max` colors by median cut over a 5-bit per
+ * channel histogram, refined by a couple of k-means passes over the bins
+ */
+static int
+bare_bmp__palette_quantize(bmp_palette_t *palette, const uint8_t *rgba, int64_t width, int64_t height, size_t stride, uint32_t max) {
+  uint32_t *histogram = calloc(32768, sizeof(uint32_t));
+  bmp_palette_bin_t *bins = malloc(32768 * sizeof(bmp_palette_bin_t));
+  uint8_t *inverse = malloc(32768);
+
+  if (histogram == NULL || bins == NULL || inverse == NULL) {
+    free(histogram);
+    free(bins);
+    free(inverse);
+    return -1;
+  }
+
+  for (int64_t y = 0; y < height; y++) {
+    const uint8_t *px = rgba + y * stride;
+
+    for (int64_t x = 0; x < width; x++, px += 4) {
+      histogram[(px[0] >> 3) << 10 | (px[1] >> 3) << 5 | (px[2] >> 3)]++;
+    }
+  }
+
+  uint32_t bin_count = 0;
+
+  for (uint32_t i = 0; i < 32768; i++) {
+    if (histogram[i] == 0) continue;
+
+    bins[bin_count].color = i;
+    bins[bin_count].count = histogram[i];
+    bin_count++;
+  }
+
+  bmp_palette_box_t boxes[256];
+  uint32_t box_count = 1;
+
+  boxes[0].start = 0;
+  boxes[0].end = bin_count;
+  bare_bmp__shrink_box(&boxes[0], bins);
+
+  // Repeatedly split the most populous, widest box at its weighted median
+  while (box_count < max) {
+    int64_t best = -1;
+    uint64_t best_score = 0;
+    int channel = 0;
+
+    for (uint32_t i = 0; i < box_count; i++) {
+      if (boxes[i].end - boxes[i].start < 2) continue;
+
+      for (int c = 0; c < 3; c++) {
+        uint64_t score = (uint64_t) (boxes[i].max[c] - boxes[i].min[c]) * boxes[i].count;
+
+        if (score > best_score) {
+          best = i;
+          best_score = score;
+          channel = c;
+        }
+      }
+    }
+
+    if (best < 0) break;
+
+    bmp_palette_box_t *box = &boxes[best];
+    uint32_t shift = 10 - channel * 5;
+
+    for (uint32_t i = box->start; i < box->end; i++) {
+      bins[i].key = (bins[i].color >> shift) & 31;
+    }
+
+    qsort(bins + box->start, box->end - box->start, sizeof(bmp_palette_bin_t), bare_bmp__compare_bins);
+
+    uint64_t half = box->count / 2, sum = 0;
+    uint32_t split = box->start + 1;
+
+    for (uint32_t i = box->start; i < box->end - 1; i++) {
+      sum += bins[i].count;
+      split = i + 1;
+      if (sum >= half) break;
+    }
+
+    bmp_palette_box_t *next = &boxes[box_count++];
+    next->start = split;
+    next->end = box->end;
+    box->end = split;
+
+    bare_bmp__shrink_box(box, bins);
+    bare_bmp__shrink_box(next, bins);
+  }
+
+  palette->len = box_count;
+  palette->exact = false;
+  palette->inverse = inverse;
+
+  uint64_t sums[256][4];
+
+  for (int pass = 0; pass < 3; pass++) {
+    memset(sums, 0, sizeof(sums));
+
+    for (uint32_t b = 0; b < box_count; b++) {
+      for (uint32_t i = boxes[b].start; i < boxes[b].end; i++) {
+        uint8_t rgb[3];
+        bare_bmp__bin_rgb(bins[i].color, rgb);
+
+        // The first pass averages the median cut boxes, later passes the
+        // clusters assigned by the previous pass
+        uint32_t index = pass == 0 ? b : inverse[bins[i].color];
+
+        for (int c = 0; c < 3; c++) sums[index][c] += (uint64_t) rgb[c] * bins[i].count;
+        sums[index][3] += bins[i].count;
+      }
+    }
+
+    for (uint32_t i = 0; i < box_count; i++) {
+      if (sums[i][3] == 0) continue;
+
+      for (int c = 0; c < 3; c++) {
+        palette->rgb[i][c] = (sums[i][c] + sums[i][3] / 2) / sums[i][3];
+      }
+    }
+
+    for (uint32_t i = 0; i < bin_count; i++) {
+      uint8_t rgb[3];
+      bare_bmp__bin_rgb(bins[i].color, rgb);
+
+      inverse[bins[i].color] = bare_bmp__nearest_color(palette, rgb);
+    }
+  }
+
+  free(histogram);
+  free(bins);
+
+  return 0;
+}
+
+/**
+ * Pack a row of RGBA pixels to 1/4/8-bit palette indices
+ */
+static void
+bare_bmp__encode_row_indexed(const bmp_palette_t *palette, const uint8_t *src, uint8_t *dst, int64_t width, uint32_t bpp) {
+  if (bpp == 8) {
+    for (int64_t x = 0; x < width; x++, src += 4) {
+      dst[x] = bare_bmp__palette_index(palette, src);
+    }
+
+    return;
+  }
+
+  uint32_t per_byte = 8 / bpp;
+
+  for (int64_t x = 0; x < width; x += per_byte) {
+    uint8_t byte = 0;
+
+    for (uint32_t i = 0; i < per_byte; i++) {
+      uint8_t index = x + i < width ? bare_bmp__palette_index(palette, src) : 0;
+      byte |= index << (8 - bpp * (i + 1));
+
+      if (x + i < width) src += 4;
+    }
+
+    *dst++ = byte;
+  }
+}
+
+/**
+ * Run-length encode a row of palette indices, one per byte, as RLE8 or RLE4
+ * and return the number of bytes written. Nothing is written if dst is NULL,
+ * which allows sizing the output up front.
+ */
+static size_t
+bare_bmp__encode_row_rle(const uint8_t *src, uint8_t *dst, int64_t width, bool rle4) {
+  size_t n = 0;
+
+#define V(byte) \
+  { \
+    if (dst) dst[n] = (byte); \
+    n++; \
+  }
+
+  int64_t x = 0;
+
+  while (x < width) {
+    uint8_t value = src[x];
+
+    int64_t run = 1;
+    while (x + run < width && run < 255 && src[x + run] == value) run++;
+
+    // Encoded mode, RLE4 runs alternate between the two nibbles of the value
+    if (run >= 3) {
+      V(run)
+      V(rle4 ? value << 4 | value : value)
+
+      x += run;
+      continue;
+    }
+
+    // Gather pixels up to the next run worth encoding
+    int64_t end = x;
+
+    while (end < width && end - x < 255) {
+      if (end + 2 < width && src[end] == src[end + 1] && src[end] == src[end + 2]) break;
+      end++;
+    }
+
+    int64_t len = end - x;
+
+    if (len < 3) {
+      // Absolute mode needs at least 3 pixels
+      if (rle4 && len == 2) {
+        V(2)
+        V(src[x] << 4 | src[x + 1])
+      } else {
+        for (int64_t i = 0; i < len; i++) {
+          V(1)
+          V(rle4 ? src[x + i] << 4 | src[x + i] : src[x + i])
+        }
+      }
+    } else {
+      // Absolute mode, padded to a 16-bit boundary
+      V(0)
+      V(len)
+
+      int64_t bytes = rle4 ? (len + 1) / 2 : len;
+
+      for (int64_t i = 0; i < bytes; i++) {
+        if (!rle4) V(src[x + i])
+        else V(src[x + i * 2] << 4 | (i * 2 + 1 < len ? src[x + i * 2 + 1] : 0))
+      }
+
+      if (bytes & 1) V(0)
+    }
+
+    x = end;
+  }
+
+  // End of line
+  V(0)
+  V(0)
+#undef V
+
+  return n;
+}
+
+/**
+ * Run-length encode an RGBA image with an exact palette bottom-up, returning
+ * the size of the encoded pixels including the end of bitmap marker. Nothing
+ * is written if dst is NULL.
+ */
+static size_t
+bare_bmp__encode_rle(const bmp_palette_t *palette, const uint8_t *rgba, int64_t width, int64_t height, size_t stride, bool rle4, uint8_t *indices, uint8_t *dst) {
+  size_t n = 0;
+
+  for (int64_t y = height - 1; y >= 0; y--) {
+    bare_bmp__encode_row_indexed(palette, rgba + y * stride, indices, width, 8);
+
+    n += bare_bmp__encode_row_rle(indices, dst ? dst + n : NULL, width, rle4);
+  }
+
+  // End of bitmap
+  if (dst) {
+    dst[n] = 0;
+    dst[n + 1] = 1;
+  }
+
+  return n + 2;
+}
+
+// Properties of an RGBA image used to pick its smallest lossless encoding
+typedef struct {
+  bool opaque;
+  bool rgb565;
+  bool rgb555;
+  uint64_t runs;
+} bmp_analysis_t;
+
+/**
+ * Analyze an RGBA image in a single pass. Channels are lossless at 5 or 6
+ * bits when bit replication of their top bits restores them, and runs count
+ * the horizontal spans of a single color.
+ */
+static void
+bare_bmp__analyze(const uint8_t *rgba, int64_t width, int64_t height, size_t stride, bmp_analysis_t *analysis) {
+  uint8_t alpha = 0xFF;
+  uint8_t miss_5 = 0, miss_g5 = 0, miss_g6 = 0;
+  uint64_t runs = 0;
+
+  for (int64_t y = 0; y < height; y++) {
+    const uint8_t *px = rgba + y * stride;
+    uint32_t last = 0;
+
+    for (int64_t x = 0; x < width; x++, px += 4) {
+      uint8_t r = px[0], g = px[1], b = px[2];
+
+      alpha &= px[3];
+      miss_5 |= ((r & 7) ^ (r >> 5)) | ((b & 7) ^ (b >> 5));
+      miss_g5 |= (g & 7) ^ (g >> 5);
+      miss_g6 |= (g & 3) ^ (g >> 6);
+
+      uint32_t value;
+      memcpy(&value, px, 4);
+
+      runs += x == 0 || value != last;
+      last = value;
+    }
+  }
+
+  analysis->opaque = alpha == 0xFF;
+  analysis->rgb565 = (miss_5 | miss_g6) == 0;
+  analysis->rgb555 = (miss_5 | miss_g5) == 0;
+  analysis->runs = runs;
+}
+
+// Input pixel formats for encoding
+#define BMP_INPUT_RGBA   0
+#define BMP_INPUT_RGB    1
+#define BMP_INPUT_BGRA   2
+#define BMP_INPUT_BGRX   3
+#define BMP_INPUT_GRAY   4
+#define BMP_INPUT_RGBA16 5 // Linear 16-bit RGBA, as decoded
+
+static const uint32_t bare_bmp__input_size[] = {4, 3, 4, 4, 1, 8};
+
+/**
+ * Convert a row of input pixels to RGBA for the encoders that need it
+ */
+static void
+bare_bmp__input_row(int64_t input, const uint8_t *src, uint8_t *dst, int64_t width, const uint8_t *to_srgb) {
+  switch (input) {
+  case BMP_INPUT_RGB:
+    for (int64_t x = 0; x < width; x++, src += 3, dst += 4) {
+      dst[0] = src[0];
+      dst[1] = src[1];
+      dst[2] = src[2];
+      dst[3] = 0xFF;
+    }
+    break;
+
+  case BMP_INPUT_BGRA:
+  case BMP_INPUT_BGRX: {
+    bool has_alpha = input == BMP_INPUT_BGRA;
+
+    for (int64_t x = 0; x < width; x++, src += 4, dst += 4) {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+      dst[3] = has_alpha ? src[3] : 0xFF;
+    }
+    break;
+  }
+
+  case BMP_INPUT_GRAY:
+    for (int64_t x = 0; x < width; x++, src += 1, dst += 4) {
+      dst[0] = dst[1] = dst[2] = src[0];
+      dst[3] = 0xFF;
+    }
+    break;
+
+  case BMP_INPUT_RGBA16:
+    for (int64_t x = 0; x < width; x++, src += 8, dst += 4) {
+      uint16_t rgba[4];
+      memcpy(rgba, src, 8);
+
+      // 12 bits of linear precision are plenty for 8-bit sRGB output
+      dst[0] = to_srgb[rgba[0] >> 4];
+      dst[1] = to_srgb[rgba[1] >> 4];
+      dst[2] = to_srgb[rgba[2] >> 4];
+      dst[3] = (rgba[3] * 255 + 32767) / 65535;
+    }
+    break;
+  }
+}
+
+/**
+ * Swap a row of RGB pixels to BGR
+ */
+static void
+bare_bmp__encode_row_rgb(const uint8_t *src, uint8_t *dst, int64_t width) {
+  for (int64_t x = 0; x < width; x++) {
+    dst[0] = src[2]; // B
+    dst[1] = src[1]; // G
+    dst[2] = src[0]; // R
+
+    src += 3;
+    dst += 3;
+  }
+}
+
+/**
+ * Convert a row of 24-bit BGR or 32-bit BGRA pixels between the two layouts
+ * without going through RGBA
+ */
+static void
+bare_bmp__transcode_row(const uint8_t *src, uint32_t src_bpp, bool has_alpha, uint8_t *dst, uint32_t dst_bpp, int64_t width) {
+  if (src_bpp == dst_bpp && (src_bpp == 24 || has_alpha)) {
+    memcpy(dst, src, width * (src_bpp / 8));
+    return;
+  }
+
+  uint32_t src_step = src_bpp / 8;
+
+  if (dst_bpp == 24) {
+    for (int64_t x = 0; x < width; x++) {
+      dst[0] = src[0]; // B
+      dst[1] = src[1]; // G
+      dst[2] = src[2]; // R
+
+      src += src_step;
+      dst += 3;
+    }
+  } else {
+    for (int64_t x = 0; x < width; x++) {
+      dst[0] = src[0];                    // B
+      dst[1] = src[1];                    // G
+      dst[2] = src[2];                    // R
+      dst[3] = has_alpha ? src[3] : 0xFF; // A
+
+      src += src_step;
+      dst += 4;
+    }
+  }
+}
+
+/**
+ * Convert a row of RGBA pixels to BGR, dropping alpha
+ */
+static void
+bare_bmp__encode_row_24(const uint8_t *src, uint8_t *dst, int64_t width) {
+  for (int64_t x = 0; x < width; x++) {
+    dst[0] = src[2]; // B
+    dst[1] = src[1]; // G
+    dst[2] = src[0]; // R
+
+    src += 4;
+    dst += 3;
+  }
+}
+
+/**
+ * Convert a row of RGBA pixels to BGRA, rows are always 4-byte aligned
+ */
+static void
+bare_bmp__encode_row_32(const uint8_t *src, uint8_t *dst, int64_t width) {
+  for (int64_t x = 0; x < width; x++) {
+    dst[0] = src[2]; // B
+    dst[1] = src[1]; // G
+    dst[2] = src[0]; // R
+    dst[3] = src[3]; // A
+
+    src += 4;
+    dst += 4;
+  }
+}
+
+// State for encoding black and white 1-bit rows
+typedef struct {
+  int32_t threshold;
+  int dither;
+  int16_t *error; // Three rows of luma diffusion error
+  int64_t width;
+} bmp_encoder_1_t;
+
+static inline int32_t
+bare_bmp__luma(const uint8_t *rgba) {
+  return (77 * rgba[0] + 150 * rgba[1] + 29 * rgba[2] + 128) >> 8;
+}
+
+/**
+ * Pick the threshold that maximizes the between-class variance of the luma
+ * histogram (Otsu's method)
+ */
+static int32_t
+bare_bmp__otsu_threshold(const uint8_t *rgba, int64_t width, int64_t height, size_t stride) {
+  uint64_t histogram[256] = {0};
+
+  for (int64_t y = 0; y < height; y++) {
+    const uint8_t *px = rgba + y * stride;
+
+    for (int64_t x = 0; x < width; x++, px += 4) {
+      histogram[bare_bmp__luma(px)]++;
+    }
+  }
+
+  uint64_t total = width * height, sum = 0;
+  for (uint32_t i = 0; i < 256; i++) sum += i * histogram[i];
+
+  uint64_t weight = 0, sum_below = 0;
+  double best_variance = -1;
+  int32_t threshold = 128;
+
+  for (uint32_t i = 0; i < 256; i++) {
+    weight += histogram[i];
+    if (weight == 0) continue;
+    if (weight == total) break;
+
+    sum_below += i * histogram[i];
+
+    double mean_below = (double) sum_below / weight;
+    double mean_above = (double) (sum - sum_below) / (total - weight);
+    double variance = (double) weight * (total - weight) * (mean_below - mean_above) * (mean_below - mean_above);
+
+    // Pixels above the class boundary are white
+    if (variance > best_variance) {
+      best_variance = variance;
+      threshold = i + 1;
+    }
+  }
+
+  return threshold;
+}
+
+static int
+bare_bmp__init_encoder_1(bmp_encoder_1_t *enc, int64_t width, int32_t threshold, int dither) {
+  enc->threshold = threshold;
+  enc->dither = dither;
+  enc->width = width;
+  enc->error = NULL;
+
+  if (dither == BMP_DITHER_FLOYD_STEINBERG || dither == BMP_DITHER_ATKINSON) {
+    enc->error = calloc((width + 4) * 3, sizeof(int16_t));
+    if (enc->error == NULL) return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Threshold a row of RGBA pixels and pack them 8 per byte, most significant
+ * bit first, with index 0 black and 1 white
+ */
+static void
+bare_bmp__encode_row_1(bmp_encoder_1_t *enc, const uint8_t *src, uint8_t *dst, int64_t y) {
+  int64_t width = enc->width;
+  int32_t threshold = enc->threshold;
+
+  if (enc->dither == BMP_DITHER_NONE || enc->dither == BMP_DITHER_ORDERED) {
+    const uint8_t *bayer = bare_bmp__bayer[y & 7];
+
+    for (int64_t x = 0; x < width; x += 8) {
+      uint8_t byte = 0;
+
+      for (int64_t i = 0; i < 8 && x + i < width; i++, src += 4) {
+        int32_t t = threshold;
+
+        // Spread the threshold around its nominal value in a Bayer pattern
+        if (enc->dither == BMP_DITHER_ORDERED) t += (bayer[(x + i) & 7] * 2 + 1) * 255 / 128 - 128;
+
+        byte |= (bare_bmp__luma(src) >= t) << (7 - i);
+      }
+
+      *dst++ = byte;
+    }
+
+    return;
+  }
+
+  // Error rows rotate through the buffer, each padded by two entries on
+  // either side so the kernels can spill without bounds checks
+  int64_t stride = width + 4;
+  int16_t *rows[3];
+
+  for (int i = 0; i < 3; i++) rows[i] = enc->error + ((y + i) % 3) * stride + 2;
+
+  memset(rows[2] - 2, 0, stride * sizeof(int16_t));
+
+  bool atkinson = enc->dither == BMP_DITHER_ATKINSON;
+
+  for (int64_t x = 0; x < width; x += 8) {
+    uint8_t byte = 0;
+
+    for (int64_t i = 0; i < 8 && x + i < width; i++, src += 4) {
+      int64_t col = x + i;
+      int32_t v = bare_bmp__luma(src) + rows[0][col] / 16;
+      int32_t bit = v >= threshold;
+      int32_t e = v - (bit ? 255 : 0);
+
+      if (atkinson) {
+        // Atkinson diffuses 6/8 of the error, which keeps highlights crisp
+        int16_t d = e * 2;
+
+        rows[0][col + 1] += d;
+        rows[0][col + 2] += d;
+        rows[1][col - 1] += d;
+        rows[1][col] += d;
+        rows[1][col + 1] += d;
+        rows[2][col] += d;
+      } else {
+        rows[0][col + 1] += e * 7;
+        rows[1][col - 1] += e * 3;
+        rows[1][col] += e * 5;
+        rows[1][col + 1] += e;
+      }
+
+      byte |= bit << (7 - i);
+    }
+
+    *dst++ = byte;
+  }
+}
+
+/**
+ * Write the file and DIB headers of a BMP to zeroed memory. 16-bit and
+ * 32-bit output use BI_BITFIELDS, with 32-bit output using a BITMAPV5HEADER
+ * to declare the alpha channel. A negative height stores rows top-down.
+ */
+static bmp_dib_header_t *
+bare_bmp__write_headers(uint8_t *bmp_data, size_t file_size, size_t data_offset, int64_t width, int64_t height, uint32_t bpp) {
+  // Create file header
+  bmp_file_header_t *file_header = (bmp_file_header_t *) bmp_data;
+  file_header->magic = 0x4D42; // 'BM'
+  file_header->file_size = file_size;
+  file_header->reserved1 = 0;
+  file_header->reserved2 = 0;
+  file_header->data_offset = data_offset;
+
+  // Create DIB header
+  bmp_dib_header_t *dib_header = (bmp_dib_header_t *) (bmp_data + sizeof(bmp_file_header_t));
+  dib_header->header_size = bpp == 32 ? sizeof(bmp_v5_header_t) : sizeof(bmp_dib_header_t);
+  dib_header->width = width;
+  dib_header->height = height; // Positive = bottom-up
+  dib_header->planes = 1;
+  dib_header->bpp = bpp;
+  dib_header->compression = bpp == 16 || bpp == 32 ? BMP_BI_BITFIELDS : BMP_BI_RGB;
+  dib_header->image_size = file_size - data_offset;
+  dib_header->x_pixels_per_m = 2835; // 72 DPI
+  dib_header->y_pixels_per_m = 2835; // 72 DPI
+  dib_header->colors_important = 0;
+
+  if (bpp == 32) {
+    bmp_v5_header_t *v5_header = (bmp_v5_header_t *) dib_header;
+    v5_header->red_mask = 0x00FF0000;
+    v5_header->green_mask = 0x0000FF00;
+    v5_header->blue_mask = 0x000000FF;
+    v5_header->alpha_mask = 0xFF000000;
+    v5_header->cs_type = 0x73524742; // 'sRGB'
+    v5_header->intent = 4;           // LCS_GM_IMAGES
+  }
+
+  return dib_header;
+}
+
+/**
+ * Encode RGBA data to BMP format (1/4/8-bit indexed, optionally RLE
+ * compressed, 16-bit RGB555/RGB565, 24-bit BGR or 32-bit BGRA)
+ * Outputs bottom-up format (standard BMP) unless top-down is requested
+ */
+static js_value_t *
+bare_bmp_encode(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 2;
+  js_value_t *argv[2];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 2);
+
+  // Get options {inputFormat, bpp, mode, dither, palette, threshold}
+  js_value_t *opts = argv[1];
+
+  int64_t input;
+  err = bare_bmp__get_option(env, opts, "inputFormat", &input);
+  assert(err == 0);
+
+  // Get image object {width, height, data}
+  bmp_image_t image;
+  err = bare_bmp__get_image(env, argv[0], bare_bmp__input_size[input], &image);
+  if (err < 0) return NULL;
+
+  int64_t width = image.width;
+  int64_t height = image.height;
+  size_t stride = image.stride;
+  uint8_t *rgba_data = image.data;
+
+  int64_t bpp;
+  err = bare_bmp__get_option(env, opts, "bpp", &bpp);
+  assert(err == 0);
+
+  int64_t mode;
+  err = bare_bmp__get_option(env, opts, "mode", &mode);
+  assert(err == 0);
+
+  int64_t dither;
+  err = bare_bmp__get_option(env, opts, "dither", &dither);
+  assert(err == 0);
+
+  int64_t palette_type;
+  err = bare_bmp__get_option(env, opts, "palette", &palette_type);
+  assert(err == 0);
+
+  int64_t threshold;
+  err = bare_bmp__get_option(env, opts, "threshold", &threshold);
+  assert(err == 0);
+
+  js_value_t *val;
+  err = js_get_named_property(env, opts, "optimize", &val);
+  assert(err == 0);
+
+  bool optimize;
+  err = js_get_value_bool(env, val, &optimize);
+  assert(err == 0);
+
+  err = js_get_named_property(env, opts, "topDown", &val);
+  assert(err == 0);
+
+  bool top_down;
+  err = js_get_value_bool(env, val, &top_down);
+  assert(err == 0);
+
+  err = js_get_named_property(env, opts, "premultiplied", &val);
+  assert(err == 0);
+
+  bool premultiplied;
+  err = js_get_value_bool(env, val, &premultiplied);
+  assert(err == 0);
+
+  int64_t pixels_per_m;
+  err = bare_bmp__get_option(env, opts, "pixelsPerMeter", &pixels_per_m);
+  assert(err == 0);
+
+  int64_t rotate;
+  err = bare_bmp__get_option(env, opts, "rotate", &rotate);
+  assert(err == 0);
+
+  err = js_get_named_property(env, opts, "flipX", &val);
+  assert(err == 0);
+
+  bool flip_x;
+  err = js_get_value_bool(env, val, &flip_x);
+  assert(err == 0);
+
+  err = js_get_named_property(env, opts, "flipY", &val);
+  assert(err == 0);
+
+  bool flip_y;
+  err = js_get_value_bool(env, val, &flip_y);
+  assert(err == 0);
+
+  bmp_orientation_t orientation = bare_bmp__orientation(rotate, flip_x, flip_y);
+
+  uint8_t *oriented = NULL;
+
+  // Orient the input up front, as every output path reads it in row order
+  if (orientation.transpose || orientation.mirror_x || orientation.mirror_y) {
+    size_t pixel_size = bare_bmp__input_size[input];
+
+    int64_t oriented_width = orientation.transpose ? height : width;
+    int64_t oriented_height = orientation.transpose ? width : height;
+
+    oriented = malloc(oriented_width * oriented_height * pixel_size);
+
+    if (oriented == NULL) {
+      err = js_throw_error(env, NULL, "Memory allocation failed");
+      assert(err == 0);
+      return NULL;
+    }
+
+    bare_bmp__orient(rgba_data, stride, width, height, oriented, oriented_width * pixel_size, pixel_size, orientation);
+
+    width = oriented_width;
+    height = oriented_height;
+    stride = oriented_width * pixel_size;
+    rgba_data = oriented;
+  }
+
+  uint8_t *converted = NULL;
+  uint8_t *row = NULL;
+  uint8_t *bmp_data = NULL;
+
+  bmp_encoder_1_t enc_1 = {.error = NULL};
+  bmp_encoder_16_t enc_16 = {.error = NULL};
+
+  uint8_t to_srgb[4096];
+
+  if (input == BMP_INPUT_RGBA16) {
+    for (uint32_t i = 0; i < 4096; i++) {
+      to_srgb[i] = bare_bmp__linear_to_srgb(i / 4095.0f) * 255 + 0.5f;
+    }
+  }
+
+  // Gray input maps directly onto an 8-bit gray ramp. Otherwise, passes over
+  // the whole image need RGBA, so convert it up front for those.
+  bool gray = input == BMP_INPUT_GRAY && bpp == 8 && palette_type == BMP_PALETTE_AUTO && !optimize;
+
+  if (input != BMP_INPUT_RGBA && !gray && (optimize || bpp == 1 || bpp == 4 || bpp == 8)) {
+    converted = malloc(width * height * 4);
+
+    if (converted == NULL) {
+      free(oriented);
+
+      err = js_throw_error(env, NULL, "Memory allocation failed");
+      assert(err == 0);
+      return NULL;
+    }
+
+    for (int64_t y = 0; y < height; y++) {
+      bare_bmp__input_row(input, rgba_data + y * stride, converted + y * width * 4, width, to_srgb);
+    }
+
+    input = BMP_INPUT_RGBA;
+    rgba_data = converted;
+    stride = width * 4;
+  }
+
+  // Pick the smallest lossless representation. Images with alpha need 32-bit
+  // output, while opaque images use whichever of 24-bit, 16-bit if their
+  // channels survive the round-trip, and indexed, possibly run-length encoded,
+  // if they have at most 256 colors, makes for the smallest file.
+  bmp_palette_t palette = {.inverse = NULL};
+  uint32_t compression = BMP_BI_RGB;
+  size_t rle_size = 0;
+  uint8_t *indices = NULL;
+
+  if (optimize) {
+    bmp_analysis_t analysis;
+    bare_bmp__analyze(rgba_data, width, height, stride, &analysis);
+
+    dither = BMP_DITHER_NONE;
+    palette_type = BMP_PALETTE_AUTO;
+
+    if (!analysis.opaque) bpp = 32;
+    else {
+      // Compare full file sizes, headers and color tables included, keeping
+      // 24-bit unless another representation is strictly smaller
+      size_t headers = sizeof(bmp_file_header_t) + sizeof(bmp_dib_header_t);
+      size_t best = headers + (((size_t) width * 24 + 31) / 32) * 4 * height;
+
+      bpp = 24;
+
+      if (analysis.rgb565 || analysis.rgb555) {
+        size_t size = headers + 12 + (((size_t) width * 16 + 31) / 32) * 4 * height;
+
+        if (size < best) {
+          best = size;
+          bpp = 16;
+          mode = analysis.rgb565 ? 565 : 555;
+        }
+      }
+
+      if (bare_bmp__palette_exact(&palette, rgba_data, width, height, stride, 256)) {
+        uint32_t indexed_bpp = palette.len <= 2 ? 1 : palette.len <= 16 ? 4 : 8;
+
+        bool rle4 = palette.len <= 16;
+        size_t pixels = (((size_t) width * indexed_bpp + 31) / 32) * 4 * height;
+        bool rle = false;
+
+        // Every run takes at least two bytes, so only size the RLE output when
+        // there are few enough of them. RLE images are always bottom-up.
+        if (!top_down && analysis.runs * 2 + height * 2 < pixels) {
+          indices = malloc(width);
+
+          if (indices == NULL) {
+            err = js_throw_error(env, NULL, "Memory allocation failed");
+            assert(err == 0);
+            goto err;
+          }
+
+          rle_size = bare_bmp__encode_rle(&palette, rgba_data, width, height, stride, rle4, indices, NULL);
+
+          if (rle_size < pixels) {
+            pixels = rle_size;
+            rle = true;
+          }
+        }
+
+        size_t size = headers + palette.len * 4 + pixels;
+
+        if (size < best) {
+          bpp = rle ? (rle4 ? 4 : 8) : indexed_bpp;
+          compression = rle ? (rle4 ? BMP_BI_RLE4 : BMP_BI_RLE8) : BMP_BI_RGB;
+        }
+      }
+    }
+  }
+
+  bool indexed = bpp == 1 || bpp == 4 || bpp == 8;
+
+  if (!indexed && bpp != 16 && bpp != 24 && bpp != 32) {
+    err = js_throw_error(env, NULL, "Unsupported BMP: only 1-bit, 4-bit, 8-bit, 16-bit, 24-bit and 32-bit encoding supported");
+    assert(err == 0);
+    goto err;
+  }
+
+  bool mono = palette_type == BMP_PALETTE_MONO;
+
+  if (mono && bpp != 1) {
+    err = js_throw_error(env, NULL, "Unsupported BMP: monochrome palettes require 1-bit encoding");
+    assert(err == 0);
+    goto err;
+  }
+
+  if (dither == BMP_DITHER_ATKINSON && !mono) {
+    err = js_throw_error(env, NULL, "Unsupported BMP: Atkinson dithering requires monochrome encoding");
+    assert(err == 0);
+    goto err;
+  }
+
+  // Build the color table for indexed output, skipping quantization when the
+  // image already fits
+  if (mono) {
+    palette.len = 2;
+    memset(palette.rgb[0], 0x00, sizeof(palette.rgb[0]));
+    memset(palette.rgb[1], 0xFF, sizeof(palette.rgb[1]));
+
+    if (threshold < 0) threshold = bare_bmp__otsu_threshold(rgba_data, width, height, stride);
+  } else if (gray) {
+    palette.len = 256;
+
+    for (uint32_t i = 0; i < 256; i++) memset(palette.rgb[i], i, sizeof(palette.rgb[i]));
+  } else if (indexed && !optimize && !bare_bmp__palette_exact(&palette, rgba_data, width, height, stride, 1u << bpp)) {
+    err = bare_bmp__palette_quantize(&palette, rgba_data, width, height, stride, 1u << bpp);
+    if (err < 0) {
+      err = js_throw_error(env, NULL, "Memory allocation failed");
+      assert(err == 0);
+      goto err;
+    }
+  }
+
+  // 16-bit output carries its channel masks after the DIB header while 32-bit
+  // output uses a BITMAPV5HEADER to declare the alpha channel
+  uint32_t header_size = bpp == 32 ? sizeof(bmp_v5_header_t) : sizeof(bmp_dib_header_t);
+  uint32_t masks_size = bpp == 16 ? 12 : 0;
+  uint32_t palette_size = indexed ? palette.len * 4 : 0;
+
+  // Calculate row size with 4-byte padding
+  size_t row_size = (((size_t) width * bpp + 31) / 32) * 4;
+  size_t pixel_data_size = compression == BMP_BI_RGB ? row_size * height : rle_size;
+  size_t data_offset = sizeof(bmp_file_header_t) + header_size + masks_size + palette_size;
+  size_t file_size = data_offset + pixel_data_size;
+
+  if (file_size > UINT32_MAX) {
+    err = js_throw_error(env, NULL, "Invalid RGBA: image too large");
+    assert(err == 0);
+    goto err;
+  }
+
+  // Allocate output buffer and row encoder state
+  bmp_data = malloc(file_size);
+
+  if (bmp_data) {
+    if (mono) err = bare_bmp__init_encoder_1(&enc_1, width, threshold, dither);
+    else if (bpp == 16) err = bare_bmp__init_encoder_16(&enc_16, width, mode == 565, dither);
+    else err = 0;
+  }
+
+  // Rows without a dedicated kernel for their input format go through RGBA
+  if (bmp_data && err == 0 && input != BMP_INPUT_RGBA) {
+    row = malloc(width * 4);
+    if (row == NULL) err = -1;
+  }
+
+  if (!bmp_data || err < 0) {
+    err = js_throw_error(env, NULL, "Memory allocation failed");
+    assert(err == 0);
+    goto err;
+  }
+
+  memset(bmp_data, 0, file_size);
+
+  bmp_dib_header_t *dib_header = bare_bmp__write_headers(bmp_data, file_size, data_offset, width, top_down ? -height : height, bpp);
+  dib_header->x_pixels_per_m = pixels_per_m;
+  dib_header->y_pixels_per_m = pixels_per_m;
+  dib_header->colors_used = indexed ? palette.len : 0;
+
+  if (compression != BMP_BI_RGB) dib_header->compression = compression;
+
+  if (indexed) {
+    uint8_t *entry = bmp_data + sizeof(bmp_file_header_t) + header_size;
+
+    for (uint32_t i = 0; i < palette.len; i++, entry += 4) {
+      entry[0] = palette.rgb[i][2]; // B
+      entry[1] = palette.rgb[i][1]; // G
+      entry[2] = palette.rgb[i][0]; // R
+    }
+  }
+
+  if (bpp == 16) {
+    bmp_masks_t masks;
+
+    for (int c = 0; c < 3; c++) {
+      masks[c] = ((1 << enc_16.bits[c]) - 1) << enc_16.shift[c];
+    }
+
+    memcpy(bmp_data + sizeof(bmp_file_header_t) + sizeof(bmp_dib_header_t), masks, masks_size);
+  }
+
+  // Convert RGBA to BGR(A), packed 16-bit or palette indices
+  uint8_t *pixel_data = bmp_data + data_offset;
+
+  if (compression != BMP_BI_RGB) {
+    bare_bmp__encode_rle(&palette, rgba_data, width, height, stride, compression == BMP_BI_RLE4, indices, pixel_data);
+  } else if (top_down && bpp == 32 && stride == (size_t) width * 4 && input == BMP_INPUT_RGBA && !premultiplied) {
+    // Unpadded rows in source order make up a single contiguous run
+    bare_bmp__encode_row_32(rgba_data, pixel_data, width * height);
+  } else if (top_down && bpp == 32 && stride == (size_t) width * 4 && input == BMP_INPUT_BGRA && !premultiplied) {
+    memcpy(pixel_data, rgba_data, width * height * 4);
+  } else {
+    for (int64_t y = 0; y < height; y++) {
+      // Write bottom-up (BMP standard) unless asked for top-down
+      int64_t dst_row = top_down ? y : height - 1 - y;
+      uint8_t *src = rgba_data + y * stride;
+      uint8_t *dst = pixel_data + dst_row * row_size;
+
+      // Input formats that are already laid out like the output
+      if ((input == BMP_INPUT_BGRA || input == BMP_INPUT_BGRX) && (bpp == 24 || bpp == 32)) {
+        bare_bmp__transcode_row(src, 32, input == BMP_INPUT_BGRA, dst, bpp, width);
+
+        if (premultiplied && bpp == 32) bare_bmp__unpremultiply_row(dst, width);
+        continue;
+      }
+
+      if (input == BMP_INPUT_RGB && bpp == 24) {
+        bare_bmp__encode_row_rgb(src, dst, width);
+        continue;
+      }
+
+      if (gray) {
+        memcpy(dst, src, width);
+        continue;
+      }
+
+      if (input != BMP_INPUT_RGBA) {
+        bare_bmp__input_row(input, src, row, width, to_srgb);
+        src = row;
+      }
+
+      if (mono) {
+        bare_bmp__encode_row_1(&enc_1, src, dst, y);
+        continue;
+      }
+
+      if (indexed) {
+        bare_bmp__encode_row_indexed(&palette, src, dst, width, bpp);
+        continue;
+      }
+
+      if (bpp == 16) {
+        bare_bmp__encode_row_16(&enc_16, src, dst, y);
+        continue;
+      }
+
+      if (bpp == 32) {
+        bare_bmp__encode_row_32(src, dst, width);
+
+        // Straight alpha is stored, so undo premultiplication while the row
+        // is still in cache
+        if (premultiplied) bare_bmp__unpremultiply_row(dst, width);
+      } else {
+        bare_bmp__encode_row_24(src, dst, width);
+      }
+      // Row padding is already zeroed by memset
+    }
+  }
+
+  free(enc_1.error);
+  free(enc_16.error);
+  free(indices);
+  free(palette.inverse);
+  free(converted);
+  free(oriented);
+  free(row);
+
+  // Create external ArrayBuffer with finalizer
+  js_value_t *result;
+  err = js_create_external_arraybuffer(env, bmp_data, file_size, bare_bmp__on_finalize, NULL, &result);
+  assert(err == 0);
+
+  return result;
+
+err:
+  free(enc_1.error);
+  free(enc_16.error);
+  free(indices);
+  free(palette.inverse);
+  free(converted);
+  free(oriented);
+  free(row);
+  free(bmp_data);
+
+  return NULL;
+}
+
+/**
+ * Transcode a BMP buffer to 24-bit BGR or 32-bit BGRA in a single pass
+ * 24-bit and 32-bit BI_RGB sources are converted directly, other sources are
+ * decoded one row at a time to RGBA before being encoded
+ */
+static js_value_t *
+bare_bmp_transcode(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 2;
+  js_value_t *argv[2];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 2);
+
+  uint8_t *src_data;
+  size_t src_len;
+  err = js_get_typedarray_info(env, argv[0], NULL, (void **) &src_data, &src_len, NULL, NULL);
+  assert(err == 0);
+
+  // Get options {bpp, topDown}
+  js_value_t *opts = argv[1];
+
+  int64_t bpp;
+  err = bare_bmp__get_option(env, opts, "bpp", &bpp);
+  assert(err == 0);
+
+  js_value_t *val;
+  err = js_get_named_property(env, opts, "topDown", &val);
+  assert(err == 0);
+
+  bool top_down;
+  err = js_get_value_bool(env, val, &top_down);
+  assert(err == 0);
+
+  if (bpp != 24 && bpp != 32) {
+    err = js_throw_error(env, NULL, "Unsupported BMP: only 24-bit and 32-bit transcoding supported");
+    assert(err == 0);
+    return NULL;
+  }
+
+  err = bare_bmp__check_file(env, src_data, src_len);
+  if (err < 0) return NULL;
+
+  bmp_file_header_t *file_header = (bmp_file_header_t *) src_data;
+
+  bmp_dib_t *dib = malloc(sizeof(bmp_dib_t));
+  bmp_decoder_t *dec = NULL;
+  uint8_t *bmp_data = NULL;
+
+  if (dib == NULL) {
+    err = js_throw_error(env, NULL, "Memory allocation failed");
+    assert(err == 0);
+    return NULL;
+  }
+
+  err = bare_bmp__parse_dib(env, src_data + sizeof(bmp_file_header_t), src_len - sizeof(bmp_file_header_t), file_header->data_offset - sizeof(bmp_file_header_t), false, dib);
+  if (err < 0) goto err;
+
+  if (dib->compression == BMP_BI_JPEG || dib->compression == BMP_BI_PNG) {
+    err = js_throw_error(env, NULL, "Unsupported BMP: embedded JPEG and PNG streams cannot be transcoded");
+    assert(err == 0);
+    goto err;
+  }
+
+  int64_t width = dib->width;
+  int64_t height = dib->height;
+
+  size_t row_size = (((size_t) width * bpp + 31) / 32) * 4;
+  size_t data_offset = sizeof(bmp_file_header_t) + (bpp == 32 ? sizeof(bmp_v5_header_t) : sizeof(bmp_dib_header_t));
+  size_t file_size = data_offset + row_size * height;
+
+  if (file_size > UINT32_MAX) {
+    err = js_throw_error(env, NULL, "Invalid BMP: image too large");
+    assert(err == 0);
+    goto err;
+  }
+
+  // Sources other than plain BGR(A) are decoded through a single RGBA row
+  bool direct = !dib->bitfields && (dib->bpp == 24 || dib->bpp == 32);
+
+  if (!direct) {
+    bmp_decode_options_t options = {.format = BMP_FORMAT_RGBA, .tone_map = false};
+
+    dec = malloc(sizeof(bmp_decoder_t));
+
+    if (dec == NULL || bare_bmp__init_decoder(dec, &options, width, 1, dib->bpp == 64) < 0) {
+      free(dec);
+      dec = NULL;
+
+      err = js_throw_error(env, NULL, "Memory allocation failed");
+      assert(err == 0);
+      goto err;
+    }
+  }
+
+  bmp_data = malloc(file_size);
+
+  if (bmp_data == NULL) {
+    err = js_throw_error(env, NULL, "Memory allocation failed");
+    assert(err == 0);
+    goto err;
+  }
+
+  memset(bmp_data, 0, file_size);
+
+  bare_bmp__write_headers(bmp_data, file_size, data_offset, width, top_down ? -height : height, bpp);
+
+  uint8_t *pixel_data = bmp_data + data_offset;
+
+  for (int64_t y = 0; y < height; y++) {
+    int64_t dst_row = top_down ? y : height - 1 - y;
+    uint8_t *dst = pixel_data + dst_row * row_size;
+
+    if (direct) {
+      int64_t src_row = dib->top_down ? y : height - 1 - y;
+      const uint8_t *src = dib->pixels + src_row * dib->row_size;
+
+      bare_bmp__transcode_row(src, dib->bpp, dib->has_alpha, dst, bpp, width);
+      continue;
+    }
+
+    bare_bmp__decode_dib_row(dib, y, dec, 0);
+
+    if (bpp == 32) bare_bmp__encode_row_32(dec->data, dst, width);
+    else bare_bmp__encode_row_24(dec->data, dst, width);
+  }
+
+  if (dec) {
+    bare_bmp__destroy_decoder(dec);
+    free(dec->data);
+    free(dec);
+  }
+
+  bare_bmp__destroy_dib(dib);
+
+  js_value_t *result;
+  err = js_create_external_arraybuffer(env, bmp_data, file_size, bare_bmp__on_finalize, NULL, &result);
+  assert(err == 0);
+
+  return result;
+
+err:
+  if (dec) {
+    bare_bmp__destroy_decoder(dec);
+    free(dec->data);
+    free(dec);
+  }
+
+  bare_bmp__destroy_dib(dib);
+
+  return NULL;
+}
+
+/**
+ * Halve an RGBA image with a 2x2 box filter, weighting colors by alpha so
+ * transparent pixels don't bleed into their neighbours
+ */
 static void
-bare_bmp__on_finalize(js_env_t *env, void *data, void *finalize_hint) {
-  free(data);
+bare_bmp__downscale_half(const uint8_t *src, int64_t src_width, int64_t src_height, size_t src_stride, uint8_t *dst, int64_t dst_width, int64_t dst_height) {
+  for (int64_t y = 0; y < dst_height; y++) {
+    const uint8_t *row[2] = {
+      src + (y * 2 < src_height ? y * 2 : src_height - 1) * src_stride,
+      src + (y * 2 + 1 < src_height ? y * 2 + 1 : src_height - 1) * src_stride,
+    };
+
+    for (int64_t x = 0; x < dst_width; x++, dst += 4) {
+      int64_t cols[2] = {x * 2 < src_width ? x * 2 : src_width - 1, x * 2 + 1 < src_width ? x * 2 + 1 : src_width - 1};
+      uint32_t sum[4] = {0, 0, 0, 0};
+
+      for (int i = 0; i < 4; i++) {
+        const uint8_t *px = row[i / 2] + cols[i % 2] * 4;
+
+        for (int c = 0; c < 3; c++) sum[c] += px[c] * px[3];
+        sum[3] += px[3];
+      }
+
+      for (int c = 0; c < 3; c++) dst[c] = sum[3] ? (sum[c] + sum[3] / 2) / sum[3] : 0;
+      dst[3] = (sum[3] + 2) / 4;
+    }
+  }
 }
 
 /**
- * Decode BMP buffer to RGBA format
- * Handles 24-bit BGR and 32-bit BGRA formats
- * Supports both top-down and bottom-up orientations
+ * Bilinearly resample an RGBA image to a 32-bit icon DIB, writing BGRA rows
+ * bottom-up followed by an AND mask of the transparent pixels
+ * Resampling to the source dimensions is an exact copy
+ */
+static void
+bare_bmp__encode_icon_image(const uint8_t *src, int64_t src_width, int64_t src_height, size_t src_stride, uint8_t *dst, int64_t width, int64_t height) {
+  uint8_t *mask = dst + width * height * 4;
+  size_t mask_row_size = ((width + 31) / 32) * 4;
+
+  for (int64_t y = 0; y < height; y++) {
+    // Source coordinates of the pixel centers in 16.16 fixed point
+    int64_t sy = ((2 * y + 1) * src_height << 16) / (2 * height) - (1 << 15);
+    if (sy < 0) sy = 0;
+
+    int64_t y0 = sy >> 16, y1 = y0 + 1 < src_height ? y0 + 1 : y0;
+    uint32_t fy = sy & 0xFFFF;
+
+    uint8_t *row = dst + (height - 1 - y) * width * 4;
+    uint8_t *mask_row = mask + (height - 1 - y) * mask_row_size;
+
+    for (int64_t x = 0; x < width; x++, row += 4) {
+      int64_t sx = ((2 * x + 1) * src_width << 16) / (2 * width) - (1 << 15);
+      if (sx < 0) sx = 0;
+
+      int64_t x0 = sx >> 16, x1 = x0 + 1 < src_width ? x0 + 1 : x0;
+      uint32_t fx = sx & 0xFFFF;
+
+      const uint8_t *p00 = src + y0 * src_stride + x0 * 4, *p01 = src + y0 * src_stride + x1 * 4;
+      const uint8_t *p10 = src + y1 * src_stride + x0 * 4, *p11 = src + y1 * src_stride + x1 * 4;
+
+      uint8_t rgba[4];
+
+      for (int c = 0; c < 4; c++) {
+        uint64_t top = p00[c] * (uint64_t) (0x10000 - fx) + p01[c] * (uint64_t) fx;
+        uint64_t bottom = p10[c] * (uint64_t) (0x10000 - fx) + p11[c] * (uint64_t) fx;
+
+        rgba[c] = (top * (0x10000 - fy) + bottom * fy + (1ull << 31)) >> 32;
+      }
+
+      row[0] = rgba[2]; // B
+      row[1] = rgba[1]; // G
+      row[2] = rgba[0]; // R
+      row[3] = rgba[3]; // A
+
+      if (rgba[3] == 0) mask_row[x / 8] |= 0x80 >> (x % 8);
+    }
+  }
+}
+
+/**
+ * Encode RGBA data to a multi-resolution ICO file of 32-bit DIB entries
+ * All sizes are resampled from a shared pyramid of halved images and written
+ * into a single preallocated buffer
  */
 static js_value_t *
-bare_bmp_decode(js_env_t *env, js_callback_info_t *info) {
+bare_bmp_encode_icon(js_env_t *env, js_callback_info_t *info) {
   int err;
 
-  size_t argc = 1;
-  js_value_t *argv[1];
+  size_t argc = 2;
+  js_value_t *argv[2];
 
   err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
   assert(err == 0);
-  assert(argc == 1);
+  assert(argc == 2);
 
-  uint8_t *bmp_data;
-  size_t bmp_len;
-  err = js_get_typedarray_info(env, argv[0], NULL, (void **) &bmp_data, &bmp_len, NULL, NULL);
+  // Get RGBA object {width, height, data}
+  bmp_image_t image;
+  err = bare_bmp__get_image(env, argv[0], 4, &image);
+  if (err < 0) return NULL;
+
+  // Get sizes
+  uint32_t count;
+  err = js_get_array_length(env, argv[1], &count);
   assert(err == 0);
 
-  // Validate minimum size
-  if (bmp_len < sizeof(bmp_file_header_t) + sizeof(bmp_dib_header_t)) {
-    err = js_throw_error(env, NULL, "Invalid BMP: file too small");
+  if (count == 0 || count > 256) {
+    err = js_throw_error(env, NULL, "Invalid ICO: between 1 and 256 sizes required");
     assert(err == 0);
     return NULL;
   }
 
-  // Parse headers
-  bmp_file_header_t *file_header = (bmp_file_header_t *) bmp_data;
-  bmp_dib_header_t *dib_header = (bmp_dib_header_t *) (bmp_data + sizeof(bmp_file_header_t));
+  int64_t sizes[256];
+  int64_t min_size = 256;
+  size_t file_size = sizeof(bmp_icon_dir_t) + count * sizeof(bmp_icon_dir_entry_t);
 
-  // Validate magic number
-  if (file_header->magic != 0x4D42) {
-    err = js_throw_error(env, NULL, "Invalid BMP: wrong magic number");
+  for (uint32_t i = 0; i < count; i++) {
+    js_value_t *size_val;
+    err = js_get_element(env, argv[1], i, &size_val);
     assert(err == 0);
-    return NULL;
-  }
-
-  // Validate DIB header size
-  if (dib_header->header_size != 40) {
-    err = js_throw_error(env, NULL, "Unsupported BMP: only BITMAPINFOHEADER supported");
+    err = js_get_value_int64(env, size_val, &sizes[i]);
     assert(err == 0);
-    return NULL;
-  }
 
-  // Validate compression
-  if (dib_header->compression != 0) {
-    err = js_throw_error(env, NULL, "Unsupported BMP: only uncompressed format supported");
-    assert(err == 0);
-    return NULL;
-  }
+    if (sizes[i] < 1 || sizes[i] > 256) {
+      err = js_throw_error(env, NULL, "Invalid ICO: sizes must be between 1 and 256");
+      assert(err == 0);
+      return NULL;
+    }
 
-  // Validate bits per pixel
-  if (dib_header->bpp != 24 && dib_header->bpp != 32) {
-    err = js_throw_error(env, NULL, "Unsupported BMP: only 24-bit and 32-bit formats supported");
-    assert(err == 0);
-    return NULL;
+    if (sizes[i] < min_size) min_size = sizes[i];
+
+    // Pixels followed by the AND mask, both using the doubled DIB height
+    file_size += sizeof(bmp_dib_header_t) + sizes[i] * sizes[i] * 4 + ((sizes[i] + 31) / 32) * 4 * sizes[i];
   }
 
-  int32_t width = dib_header->width;
-  int32_t height = dib_header->height;
-  int32_t abs_height = height < 0 ? -height : height;
-  bool top_down = height < 0;
-  uint16_t bpp = dib_header->bpp;
-  uint32_t bytes_per_pixel = bpp / 8;
+  // Size the pyramid, halving until the next level would be smaller than the
+  // smallest requested size
+  int64_t level_width[32], level_height[32];
+  size_t level_offset[32], level_stride[32];
+  size_t pyramid_size = 0;
+  int levels = 1;
 
-  // Calculate row size with 4-byte padding
-  uint32_t row_size = ((width * bytes_per_pixel + 3) / 4) * 4;
+  level_width[0] = image.width;
+  level_height[0] = image.height;
+  level_stride[0] = image.stride;
 
-  // Validate data offset and size
-  if (file_header->data_offset + (row_size * abs_height) > bmp_len) {
-    err = js_throw_error(env, NULL, "Invalid BMP: pixel data exceeds file size");
-    assert(err == 0);
-    return NULL;
+  while (levels < 32 && level_width[levels - 1] / 2 >= min_size && level_height[levels - 1] / 2 >= min_size) {
+    level_width[levels] = level_width[levels - 1] / 2;
+    level_height[levels] = level_height[levels - 1] / 2;
+    level_offset[levels] = pyramid_size;
+    level_stride[levels] = level_width[levels] * 4;
+    pyramid_size += level_width[levels] * level_height[levels] * 4;
+    levels++;
   }
 
-  // Allocate RGBA output buffer
-  uint8_t *rgba_data = malloc(width * abs_height * 4);
-  if (!rgba_data) {
+  uint8_t *ico_data = malloc(file_size);
+  uint8_t *pyramid_data = pyramid_size ? malloc(pyramid_size) : NULL;
+
+  if (!ico_data || (pyramid_size && !pyramid_data)) {
+    free(ico_data);
+    free(pyramid_data);
+
     err = js_throw_error(env, NULL, "Memory allocation failed");
     assert(err == 0);
     return NULL;
   }
 
-  uint8_t *pixel_data = bmp_data + file_header->data_offset;
+  memset(ico_data, 0, file_size);
 
-  // Convert BGR(A) to RGBA
-  for (int32_t y = 0; y < abs_height; y++) {
-    // BMP stores pixels bottom-up by default (unless height is negative)
-    int32_t src_row = top_down ? y : (abs_height - 1 - y);
-    uint8_t *src = pixel_data + src_row * row_size;
-    uint8_t *dst = rgba_data + y * width * 4;
+  const uint8_t *level_data[32] = {image.data};
 
-    for (int32_t x = 0; x < width; x++) {
-      // BGR(A) -> RGBA conversion
-      dst[0] = src[2]; // R
-      dst[1] = src[1]; // G
-      dst[2] = src[0]; // B
-      dst[3] = (bpp == 32) ? src[3] : 0xFF; // A
+  for (int i = 1; i < levels; i++) {
+    level_data[i] = pyramid_data + level_offset[i];
 
-      src += bytes_per_pixel;
-      dst += 4;
-    }
+    bare_bmp__downscale_half(level_data[i - 1], level_width[i - 1], level_height[i - 1], level_stride[i - 1], pyramid_data + level_offset[i], level_width[i], level_height[i]);
   }
 
-  // Create result object
-  js_value_t *result;
-  err = js_create_object(env, &result);
-  assert(err == 0);
+  // Create directory
+  bmp_icon_dir_t *dir = (bmp_icon_dir_t *) ico_data;
+  dir->reserved = 0;
+  dir->type = 1; // Icon
+  dir->count = count;
 
-  // Set width property
-  js_value_t *width_val;
-  err = js_create_int64(env, width, &width_val);
-  assert(err == 0);
-  err = js_set_named_property(env, result, "width", width_val);
-  assert(err == 0);
+  bmp_icon_dir_entry_t *entries = (bmp_icon_dir_entry_t *) (ico_data + sizeof(bmp_icon_dir_t));
+  size_t offset = sizeof(bmp_icon_dir_t) + count * sizeof(bmp_icon_dir_entry_t);
 
-  // Set height property
-  js_value_t *height_val;
-  err = js_create_int64(env, abs_height, &height_val);
-  assert(err == 0);
-  err = js_set_named_property(env, result, "height", height_val);
-  assert(err == 0);
+  for (uint32_t i = 0; i < count; i++) {
+    int64_t size = sizes[i];
+    size_t image_size = sizeof(bmp_dib_header_t) + size * size * 4 + ((size + 31) / 32) * 4 * size;
 
-  // Set data property (external ArrayBuffer with finalizer)
-  js_value_t *buffer;
-  err = js_create_external_arraybuffer(env, rgba_data, width * abs_height * 4, bare_bmp__on_finalize, NULL, &buffer);
-  assert(err == 0);
-  err = js_set_named_property(env, result, "data", buffer);
+    bmp_icon_dir_entry_t *entry = &entries[i];
+    entry->width = size == 256 ? 0 : size;
+    entry->height = size == 256 ? 0 : size;
+    entry->color_count = 0;
+    entry->reserved = 0;
+    entry->planes = 1;
+    entry->bpp = 32;
+    entry->size = image_size;
+    entry->offset = offset;
+
+    // Create DIB header
+    bmp_dib_header_t *dib_header = (bmp_dib_header_t *) (ico_data + offset);
+    dib_header->header_size = 40;
+    dib_header->width = size;
+    dib_header->height = size * 2; // Pixels and AND mask
+    dib_header->planes = 1;
+    dib_header->bpp = 32;
+    dib_header->compression = BMP_BI_RGB;
+    dib_header->image_size = image_size - sizeof(bmp_dib_header_t);
+
+    // Resample from the smallest level that is still at least as large
+    int level = 0;
+    while (level + 1 < levels && level_width[level + 1] >= size && level_height[level + 1] >= size) level++;
+
+    bare_bmp__encode_icon_image(level_data[level], level_width[level], level_height[level], level_stride[level], ico_data + offset + sizeof(bmp_dib_header_t), size, size);
+
+    offset += image_size;
+  }
+
+  free(pyramid_data);
+
+  // Create external ArrayBuffer with finalizer
+  js_value_t *result;
+  err = js_create_external_arraybuffer(env, ico_data, file_size, bare_bmp__on_finalize, NULL, &result);
   assert(err == 0);
 
   return result;
 }
 
 /**
- * Encode RGBA data to BMP format (24-bit BGR)
- * Always outputs bottom-up format (standard BMP)
+ * Write a RIFF chunk header and return a pointer to the chunk data
+ */
+static inline uint8_t *
+bare_bmp__riff_chunk(uint8_t *dst, const char *id, size_t size) {
+  uint32_t len = size;
+
+  memcpy(dst, id, 4);
+  memcpy(dst + 4, &len, 4);
+
+  return dst + 8;
+}
+
+/**
+ * Encode a sequence of RGBA frames to a RIFF container of uncompressed DIBs,
+ * either an AVI video or an ANI animated cursor
+ *
+ * All offsets, including the AVI index, are known up front from the frame
+ * dimensions, so the file is written front to back into a single buffer with
+ * the per-frame headers copied from one template.
  */
 static js_value_t *
-bare_bmp_encode(js_env_t *env, js_callback_info_t *info) {
+bare_bmp_encode_animated(js_env_t *env, js_callback_info_t *info) {
   int err;
 
   size_t argc = 2;
@@ -184,115 +4084,255 @@ bare_bmp_encode(js_env_t *env, js_callback_info_t *info) {
   assert(err == 0);
   assert(argc == 2);
 
-  // Get RGBA object {width, height, data}
-  js_value_t *rgba_obj = argv[0];
+  // Get options {container, bpp, fps}
+  js_value_t *opts = argv[1];
 
-  // Get width
-  js_value_t *width_val;
-  err = js_get_named_property(env, rgba_obj, "width", &width_val);
+  int64_t container;
+  err = bare_bmp__get_option(env, opts, "container", &container);
   assert(err == 0);
-  int64_t width;
-  err = js_get_value_int64(env, width_val, &width);
+
+  int64_t bpp;
+  err = bare_bmp__get_option(env, opts, "bpp", &bpp);
   assert(err == 0);
 
-  // Get height
-  js_value_t *height_val;
-  err = js_get_named_property(env, rgba_obj, "height", &height_val);
+  js_value_t *fps_val;
+  err = js_get_named_property(env, opts, "fps", &fps_val);
   assert(err == 0);
-  int64_t height;
-  err = js_get_value_int64(env, height_val, &height);
+  double fps;
+  err = js_get_value_double(env, fps_val, &fps);
   assert(err == 0);
 
-  // Get data
-  js_value_t *data_val;
-  err = js_get_named_property(env, rgba_obj, "data", &data_val);
-  assert(err == 0);
-  uint8_t *rgba_data;
-  size_t rgba_len;
-  err = js_get_typedarray_info(env, data_val, NULL, (void **) &rgba_data, &rgba_len, NULL, NULL);
+  // Get frames
+  uint32_t count;
+  err = js_get_array_length(env, argv[0], &count);
   assert(err == 0);
 
-  // Validate input
-  if (rgba_len < (size_t)(width * height * 4)) {
-    err = js_throw_error(env, NULL, "Invalid RGBA: data buffer too small");
+  if (count == 0) {
+    err = js_throw_error(env, NULL, "Invalid animation: at least one frame required");
+    assert(err == 0);
+    return NULL;
+  }
+
+  if (!(fps > 0)) {
+    err = js_throw_error(env, NULL, "Invalid animation: frame rate must be positive");
     assert(err == 0);
     return NULL;
   }
 
-  // Calculate row size with 4-byte padding (24-bit = 3 bytes per pixel)
-  uint32_t bytes_per_pixel = 3;
-  uint32_t row_size = ((width * bytes_per_pixel + 3) / 4) * 4;
-  uint32_t pixel_data_size = row_size * height;
-  uint32_t file_size = sizeof(bmp_file_header_t) + sizeof(bmp_dib_header_t) + pixel_data_size;
+  if (container == BMP_CONTAINER_ANI) bpp = 32;
 
-  // Allocate output buffer
-  uint8_t *bmp_data = malloc(file_size);
-  if (!bmp_data) {
+  if (bpp != 24 && bpp != 32) {
+    err = js_throw_error(env, NULL, "Unsupported AVI: only 24-bit and 32-bit encoding supported");
+    assert(err == 0);
+    return NULL;
+  }
+
+  bmp_image_t *frames = malloc(count * sizeof(bmp_image_t));
+  if (!frames) {
     err = js_throw_error(env, NULL, "Memory allocation failed");
     assert(err == 0);
     return NULL;
   }
 
-  memset(bmp_data, 0, file_size);
+  for (uint32_t i = 0; i < count; i++) {
+    js_value_t *frame;
+    err = js_get_element(env, argv[0], i, &frame);
+    assert(err == 0);
 
-  // Create file header
-  bmp_file_header_t *file_header = (bmp_file_header_t *) bmp_data;
-  file_header->magic = 0x4D42; // 'BM'
-  file_header->file_size = file_size;
-  file_header->reserved1 = 0;
-  file_header->reserved2 = 0;
-  file_header->data_offset = sizeof(bmp_file_header_t) + sizeof(bmp_dib_header_t);
+    err = bare_bmp__get_image(env, frame, 4, &frames[i]);
+    if (err < 0) goto err;
 
-  // Create DIB header
-  bmp_dib_header_t *dib_header = (bmp_dib_header_t *) (bmp_data + sizeof(bmp_file_header_t));
-  dib_header->header_size = 40;
-  dib_header->width = width;
-  dib_header->height = height; // Positive = bottom-up
-  dib_header->planes = 1;
-  dib_header->bpp = 24;
-  dib_header->compression = 0; // No compression
-  dib_header->image_size = pixel_data_size;
-  dib_header->x_pixels_per_m = 2835; // 72 DPI
-  dib_header->y_pixels_per_m = 2835; // 72 DPI
-  dib_header->colors_used = 0;
-  dib_header->colors_important = 0;
+    if (frames[i].width != frames[0].width || frames[i].height != frames[0].height) {
+      err = js_throw_error(env, NULL, "Invalid animation: frames must have the same dimensions");
+      assert(err == 0);
+      goto err;
+    }
+  }
 
-  // Convert RGBA to BGR and write bottom-up
-  uint8_t *pixel_data = bmp_data + file_header->data_offset;
+  int64_t width = frames[0].width;
+  int64_t height = frames[0].height;
 
-  for (int32_t y = 0; y < height; y++) {
-    // Write bottom-up (BMP standard)
-    int32_t dst_row = height - 1 - y;
-    uint8_t *src = rgba_data + y * width * 4;
-    uint8_t *dst = pixel_data + dst_row * row_size;
+  if (container == BMP_CONTAINER_ANI && (width > 256 || height > 256)) {
+    err = js_throw_error(env, NULL, "Unsupported ANI: frames must be at most 256x256");
+    assert(err == 0);
+    goto err;
+  }
 
-    for (int32_t x = 0; x < width; x++) {
-      // RGBA -> BGR conversion (skip alpha)
-      dst[0] = src[2]; // B
-      dst[1] = src[1]; // G
-      dst[2] = src[0]; // R
+  // Size the container. AVI frames are '00db' chunks of bottom-up DIB rows,
+  // ANI frames are 'icon' chunks holding a single-entry ICO file.
+  size_t row_size = (((size_t) width * bpp + 31) / 32) * 4;
+  size_t frame_size, header_size;
 
-      src += 4;
-      dst += 3;
+  if (container == BMP_CONTAINER_ANI) {
+    frame_size = sizeof(bmp_icon_dir_t) + sizeof(bmp_icon_dir_entry_t) + sizeof(bmp_dib_header_t) + row_size * height + ((width + 31) / 32) * 4 * height;
+    header_size = 12 + 8 + sizeof(bmp_ani_header_t) + 12;
+  } else {
+    frame_size = row_size * height;
+    header_size = 12 + 12 + 8 + sizeof(bmp_avi_main_header_t) + 12 + 8 + sizeof(bmp_avi_stream_header_t) + 8 + sizeof(bmp_dib_header_t) + 12;
+  }
+
+  // Chunks are padded to an even size, which the frames already are
+  size_t chunk_size = 8 + frame_size;
+  size_t index_size = container == BMP_CONTAINER_AVI ? 8 + 16 * (size_t) count : 0;
+  size_t file_size = header_size + chunk_size * count + index_size;
+
+  if (file_size > UINT32_MAX) {
+    err = js_throw_error(env, NULL, "Invalid animation: file too large");
+    assert(err == 0);
+    goto err;
+  }
+
+  uint8_t *riff_data = malloc(file_size);
+  if (!riff_data) {
+    err = js_throw_error(env, NULL, "Memory allocation failed");
+    assert(err == 0);
+    goto err;
+  }
+
+  memset(riff_data, 0, header_size);
+
+  // Template for the DIB header shared by all frames
+  bmp_dib_header_t dib_header = {
+    .header_size = sizeof(bmp_dib_header_t),
+    .width = width,
+    .height = height, // Positive = bottom-up
+    .planes = 1,
+    .bpp = bpp,
+    .compression = BMP_BI_RGB,
+    .image_size = row_size * height,
+  };
+
+  uint8_t *dst;
+  uint8_t *movi;
+
+  if (container == BMP_CONTAINER_ANI) {
+    dst = bare_bmp__riff_chunk(riff_data, "RIFF", file_size - 8);
+    memcpy(dst, "ACON", 4);
+
+    bmp_ani_header_t *ani_header = (bmp_ani_header_t *) bare_bmp__riff_chunk(dst + 4, "anih", sizeof(bmp_ani_header_t));
+    ani_header->size = sizeof(bmp_ani_header_t);
+    ani_header->frames = count;
+    ani_header->steps = count;
+    ani_header->rate = 60 / fps + 0.5 > 1 ? 60 / fps + 0.5 : 1;
+    ani_header->attributes = 1; // AF_ICON
+
+    dst = bare_bmp__riff_chunk((uint8_t *) (ani_header + 1), "LIST", 4 + chunk_size * count);
+    memcpy(dst, "fram", 4);
+
+    movi = dst + 4;
+
+    // Template for the icon directory shared by all frames, the DIB uses the
+    // doubled height of icons
+    uint8_t template[sizeof(bmp_icon_dir_t) + sizeof(bmp_icon_dir_entry_t) + sizeof(bmp_dib_header_t)];
+
+    bmp_icon_dir_t *dir = (bmp_icon_dir_t *) template;
+    dir->reserved = 0;
+    dir->type = 1; // Icon
+    dir->count = 1;
+
+    bmp_icon_dir_entry_t *entry = (bmp_icon_dir_entry_t *) (dir + 1);
+    entry->width = width == 256 ? 0 : width;
+    entry->height = height == 256 ? 0 : height;
+    entry->color_count = 0;
+    entry->reserved = 0;
+    entry->planes = 1;
+    entry->bpp = 32;
+    entry->size = frame_size - sizeof(bmp_icon_dir_t) - sizeof(bmp_icon_dir_entry_t);
+    entry->offset = sizeof(bmp_icon_dir_t) + sizeof(bmp_icon_dir_entry_t);
+
+    dib_header.height = height * 2; // Pixels and AND mask
+    dib_header.image_size = entry->size - sizeof(bmp_dib_header_t);
+    memcpy(entry + 1, &dib_header, sizeof(bmp_dib_header_t));
+
+    for (uint32_t i = 0; i < count; i++) {
+      dst = bare_bmp__riff_chunk(movi + chunk_size * i, "icon", frame_size);
+
+      memcpy(dst, template, sizeof(template));
+      memset(dst + sizeof(template), 0, frame_size - sizeof(template));
+
+      bare_bmp__encode_icon_image(frames[i].data, width, height, frames[i].stride, dst + sizeof(template), width, height);
+    }
+  } else {
+    uint32_t scale = 1000;
+    uint32_t rate = fps * scale + 0.5;
+
+    dst = bare_bmp__riff_chunk(riff_data, "RIFF", file_size - 8);
+    memcpy(dst, "AVI ", 4);
+
+    dst = bare_bmp__riff_chunk(dst + 4, "LIST", header_size - 12 - 12 - 8);
+    memcpy(dst, "hdrl", 4);
+
+    bmp_avi_main_header_t *main_header = (bmp_avi_main_header_t *) bare_bmp__riff_chunk(dst + 4, "avih", sizeof(bmp_avi_main_header_t));
+    main_header->micro_sec_per_frame = 1000000 / fps + 0.5;
+    main_header->max_bytes_per_sec = frame_size * fps + 0.5 < UINT32_MAX ? frame_size * fps + 0.5 : UINT32_MAX;
+    main_header->flags = 0x10; // AVIF_HASINDEX
+    main_header->total_frames = count;
+    main_header->streams = 1;
+    main_header->suggested_buffer_size = chunk_size;
+    main_header->width = width;
+    main_header->height = height;
+
+    dst = bare_bmp__riff_chunk((uint8_t *) (main_header + 1), "LIST", 4 + 8 + sizeof(bmp_avi_stream_header_t) + 8 + sizeof(bmp_dib_header_t));
+    memcpy(dst, "strl", 4);
+
+    bmp_avi_stream_header_t *stream_header = (bmp_avi_stream_header_t *) bare_bmp__riff_chunk(dst + 4, "strh", sizeof(bmp_avi_stream_header_t));
+    memcpy(stream_header->type, "vids", 4);
+    memcpy(stream_header->handler, "DIB ", 4);
+    stream_header->scale = scale;
+    stream_header->rate = rate;
+    stream_header->length = count;
+    stream_header->suggested_buffer_size = chunk_size;
+    stream_header->quality = -1;
+    stream_header->sample_size = frame_size;
+    stream_header->frame[2] = width;
+    stream_header->frame[3] = height;
+
+    dst = bare_bmp__riff_chunk((uint8_t *) (stream_header + 1), "strf", sizeof(bmp_dib_header_t));
+    memcpy(dst, &dib_header, sizeof(bmp_dib_header_t));
+
+    dst = bare_bmp__riff_chunk(dst + sizeof(bmp_dib_header_t), "LIST", 4 + chunk_size * count);
+    memcpy(dst, "movi", 4);
+
+    movi = dst + 4;
+
+    // The index is precomputed, offsets are relative to the 'movi' identifier
+    uint8_t *index = bare_bmp__riff_chunk(movi + chunk_size * count, "idx1", 16 * (size_t) count);
+
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t entry[3] = {0x10 /* AVIIF_KEYFRAME */, 4 + chunk_size * i, frame_size};
+
+      memcpy(index + 16 * i, "00db", 4);
+      memcpy(index + 16 * i + 4, entry, sizeof(entry));
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+      uint8_t *pixel_data = bare_bmp__riff_chunk(movi + chunk_size * i, "00db", frame_size);
+
+      for (int64_t y = 0; y < height; y++) {
+        uint8_t *src = frames[i].data + y * frames[i].stride;
+        uint8_t *dst = pixel_data + (height - 1 - y) * row_size;
+
+        if (bpp == 32) bare_bmp__encode_row_32(src, dst, width);
+        else {
+          bare_bmp__encode_row_24(src, dst, width);
+          memset(dst + width * 3, 0, row_size - width * 3);
+        }
+      }
     }
-    // Row padding is already zeroed by memset
   }
 
+  free(frames);
+
   // Create external ArrayBuffer with finalizer
   js_value_t *result;
-  err = js_create_external_arraybuffer(env, bmp_data, file_size, bare_bmp__on_finalize, NULL, &result);
+  err = js_create_external_arraybuffer(env, riff_data, file_size, bare_bmp__on_finalize, NULL, &result);
   assert(err == 0);
 
   return result;
-}
 
-/**
- * BMP format does not support animation
- */
-static js_value_t *
-bare_bmp_encode_animated(js_env_t *env, js_callback_info_t *info) {
-  int err = js_throw_error(env, NULL, "BMP format does not support animation");
-  assert(err == 0);
+err:
+  free(frames);
+
   return NULL;
 }
 
@@ -310,8 +4350,12 @@ bare_bmp_exports(js_env_t *env, js_value_t *exports) {
   }
 
   V("decode", bare_bmp_decode)
+  V("decodeDIB", bare_bmp_decode_dib)
+  V("decodeIcon", bare_bmp_decode_icon)
   V("encode", bare_bmp_encode)
+  V("encodeIcon", bare_bmp_encode_icon)
   V("encodeAnimated", bare_bmp_encode_animated)
+  V("transcode", bare_bmp_transcode)
 #undef V
 
   return exports;
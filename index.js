@@ -1,21 +1,401 @@
 const binding = require('./binding')
 
-exports.decode = function decode(buffer) {
-  const { width, height, data } = binding.decode(buffer)
+const formats = {
+  rgba: 0,
+  rgba16: 1,
+  float: 2,
+  gray: 3,
+  i420: 4,
+  nv12: 5,
+  tensor: 6,
+  rgb: 7
+}
 
-  return {
-    width,
-    height,
-    data: Buffer.from(data)
+const lumas = {
+  bt601: 0,
+  bt709: 1
+}
+
+const rotations = [0, 90, 180, 270]
+
+const layouts = {
+  chw: 0,
+  hwc: 1
+}
+
+const dtypes = {
+  float32: 0,
+  float16: 1
+}
+
+const channelOrders = {
+  rgb: 0,
+  bgr: 1
+}
+
+const inputFormats = {
+  rgba: 0,
+  rgb: 1,
+  bgra: 2,
+  bgrx: 3,
+  gray: 4,
+  rgba16: 5
+}
+
+const dithers = {
+  none: 0,
+  ordered: 1,
+  'floyd-steinberg': 2,
+  atkinson: 3
+}
+
+const palettes = {
+  auto: 0,
+  mono: 1
+}
+
+const containers = {
+  avi: 0,
+  ani: 1
+}
+
+exports.decode = function decode(buffer, opts = {}) {
+  return toImage(buffer, binding.decode(buffer, decodeOptions(opts)), opts)
+}
+
+exports.decodeDIB = function decodeDIB(buffer, opts = {}) {
+  const { offset = 0 } = opts
+
+  if (!Number.isInteger(offset) || offset < 0) {
+    throw new Error('Offset must be a non-negative integer')
   }
+
+  return toImage(
+    buffer,
+    binding.decodeDIB(buffer, offset, decodeOptions(opts)),
+    opts
+  )
+}
+
+exports.decodeIcon = function decodeIcon(buffer, opts = {}) {
+  const { size = 0 } = opts
+
+  return toImage(
+    buffer,
+    binding.decodeIcon(buffer, size, decodeOptions(opts)),
+    opts
+  )
 }
 
 exports.encode = function encode(image, opts = {}) {
-  const buffer = binding.encode(image, opts)
+  const {
+    bpp = 24,
+    mode = '565',
+    palette = 'auto',
+    threshold = 128,
+    optimize = false,
+    topDown = false,
+    resolution = 72,
+    inputFormat = 'rgba',
+    premultiplied = false,
+    rotate = 0,
+    flipX = false,
+    flipY = false
+  } = opts
+
+  let { dither = 'none' } = opts
+
+  if (dither === true) dither = 'floyd-steinberg'
+  else if (dither === false) dither = 'none'
+
+  if (!Number.isInteger(bpp)) {
+    throw new Error(`Unsupported bpp '${bpp}'`)
+  }
+
+  if (mode !== '565' && mode !== '555') {
+    throw new Error(`Unsupported mode '${mode}'`)
+  }
+
+  if (palettes[palette] === undefined) {
+    throw new Error(`Unsupported palette '${palette}'`)
+  }
+
+  if (dithers[dither] === undefined) {
+    throw new Error(`Unsupported dither '${dither}'`)
+  }
+
+  if (threshold !== 'otsu' && typeof threshold !== 'number') {
+    throw new Error(`Unsupported threshold '${threshold}'`)
+  }
+
+  if (inputFormats[inputFormat] === undefined) {
+    throw new Error(`Unsupported input format '${inputFormat}'`)
+  }
+
+  if (!rotations.includes(rotate)) {
+    throw new Error(`Unsupported rotation '${rotate}'`)
+  }
+
+  if (typeof optimize !== 'boolean') {
+    throw new Error('optimize must be a boolean')
+  }
+
+  if (typeof topDown !== 'boolean') {
+    throw new Error('topDown must be a boolean')
+  }
+
+  if (typeof premultiplied !== 'boolean') {
+    throw new Error('premultiplied must be a boolean')
+  }
+
+  if (typeof flipX !== 'boolean' || typeof flipY !== 'boolean') {
+    throw new Error('flipX and flipY must be booleans')
+  }
+
+  // The binding reads pixels as bytes, so view 16-bit data as such
+  if (inputFormat === 'rgba16' && image.data.BYTES_PER_ELEMENT !== 1) {
+    const { buffer, byteOffset, byteLength } = image.data
+
+    image = { ...image, data: new Uint8Array(buffer, byteOffset, byteLength) }
+  }
+
+  const buffer = binding.encode(image, {
+    inputFormat: inputFormats[inputFormat],
+    bpp,
+    mode: +mode,
+    dither: dithers[dither],
+    palette: palettes[palette],
+    threshold: threshold === 'otsu' ? -1 : threshold,
+    optimize,
+    topDown,
+    premultiplied,
+    rotate,
+    flipX,
+    flipY,
+    pixelsPerMeter: Math.round(resolution / 0.0254)
+  })
+
+  return Buffer.from(buffer)
+}
+
+exports.encodeIcon = function encodeIcon(image, opts = {}) {
+  const { sizes = [16, 32, 48, 256] } = opts
+
+  if (
+    !Array.isArray(sizes) ||
+    sizes.length === 0 ||
+    !sizes.every((size) => Number.isInteger(size) && size >= 1 && size <= 256)
+  ) {
+    throw new Error('Sizes must be integers between 1 and 256')
+  }
+
+  const buffer = binding.encodeIcon(image, sizes)
 
   return Buffer.from(buffer)
 }
 
-exports.encodeAnimated = function encodeAnimated() {
-  return binding.encodeAnimated()
+exports.encodeAnimated = function encodeAnimated(frames, opts = {}) {
+  const { container = 'avi', bpp = 24, fps = 30 } = opts
+
+  if (containers[container] === undefined) {
+    throw new Error(`Unsupported container '${container}'`)
+  }
+
+  if (bpp !== 24 && bpp !== 32) {
+    throw new Error(`Unsupported bpp '${bpp}'`)
+  }
+
+  if (typeof fps !== 'number' || !(fps > 0)) {
+    throw new Error('Frame rate must be a positive number')
+  }
+
+  const buffer = binding.encodeAnimated(frames, {
+    container: containers[container],
+    bpp,
+    fps
+  })
+
+  return Buffer.from(buffer)
+}
+
+exports.transcode = function transcode(buffer, opts = {}) {
+  const { bpp = 24, topDown = false } = opts
+
+  if (bpp !== 24 && bpp !== 32) {
+    throw new Error(`Unsupported bpp '${bpp}'`)
+  }
+
+  if (typeof topDown !== 'boolean') {
+    throw new Error('topDown must be a boolean')
+  }
+
+  return Buffer.from(binding.transcode(buffer, { bpp, topDown }))
+}
+
+function decodeOptions(opts) {
+  const {
+    format = 'rgba',
+    toneMap = false,
+    luma = 'bt601',
+    premultiplied = false,
+    background,
+    colorKey,
+    colorKeyTolerance = 0,
+    rotate = 0,
+    flipX = false,
+    flipY = false,
+    lut,
+    matrix,
+    layout = 'chw',
+    dtype = 'float32',
+    channels = 'rgb',
+    mean = [0, 0, 0],
+    std = [1, 1, 1],
+    crop,
+    resize
+  } = opts
+
+  if (formats[format] === undefined) {
+    throw new Error(`Unsupported format '${format}'`)
+  }
+
+  if (lumas[luma] === undefined) {
+    throw new Error(`Unsupported luma '${luma}'`)
+  }
+
+  if (background !== undefined && background.length !== 3) {
+    throw new Error('Background must have 3 channels')
+  }
+
+  if (colorKey !== undefined && colorKey.length !== 3) {
+    throw new Error('Color key must have 3 channels')
+  }
+
+  if (!rotations.includes(rotate)) {
+    throw new Error(`Unsupported rotation '${rotate}'`)
+  }
+
+  if (matrix !== undefined && matrix.length !== 12) {
+    throw new Error('Matrix must have 3 rows of 4 entries')
+  }
+
+  if (layouts[layout] === undefined) {
+    throw new Error(`Unsupported layout '${layout}'`)
+  }
+
+  if (dtypes[dtype] === undefined) {
+    throw new Error(`Unsupported dtype '${dtype}'`)
+  }
+
+  if (channelOrders[channels] === undefined) {
+    throw new Error(`Unsupported channels '${channels}'`)
+  }
+
+  if (mean.length !== 3 || std.length !== 3) {
+    throw new Error('Mean and std must have 3 channels')
+  }
+
+  if (crop !== undefined) {
+    if (!isRect(crop, ['x', 'y'], 0) || !isRect(crop, ['width', 'height'], 1)) {
+      throw new Error('Crop must have integer x, y, width and height')
+    }
+  }
+
+  if (resize !== undefined) {
+    if (!isRect(resize, ['width', 'height'], 1)) {
+      throw new Error('Resize must have integer width and height')
+    }
+
+    if (
+      crop !== undefined &&
+      (resize.width > crop.width || resize.height > crop.height)
+    ) {
+      throw new Error('Resize must not exceed the crop')
+    }
+  }
+
+  return {
+    format: formats[format],
+    toneMap,
+    luma: lumas[luma],
+    premultiplied,
+    background,
+    colorKey,
+    colorKeyTolerance,
+    rotate,
+    flipX,
+    flipY,
+    lut: lookupTables(lut),
+    matrix,
+    layout: layouts[layout],
+    dtype: dtypes[dtype],
+    channels: channelOrders[channels],
+    mean,
+    std,
+    crop,
+    resize
+  }
+}
+
+function isRect(rect, keys, min) {
+  return keys.every((key) => Number.isInteger(rect[key]) && rect[key] >= min)
+}
+
+// Pack either a single table for all channels or one per channel
+function lookupTables(lut) {
+  if (lut === undefined) return undefined
+
+  const tables = lut.length === 3 ? lut : [lut, lut, lut]
+  const data = new Uint8Array(768)
+
+  for (let i = 0; i < 3; i++) {
+    if (tables[i].length !== 256) {
+      throw new Error('LUT tables must have 256 entries')
+    }
+
+    data.set(tables[i], i * 256)
+  }
+
+  return data
+}
+
+function toImage(buffer, image, opts) {
+  const { format = 'rgba', dtype = 'float32' } = opts
+  const { width, height } = image
+
+  if (image.embedded) {
+    const { embedded, offset, length } = image
+
+    return {
+      width,
+      height,
+      embedded,
+      data: buffer.subarray(offset, offset + length)
+    }
+  }
+
+  let data
+
+  switch (format) {
+    case 'rgba16':
+      data = new Uint16Array(image.data)
+      break
+    case 'float':
+      data = new Float32Array(image.data)
+      break
+    case 'tensor':
+      data =
+        dtype === 'float16'
+          ? new Uint16Array(image.data)
+          : new Float32Array(image.data)
+      break
+    default:
+      data = Buffer.from(image.data)
+  }
+
+  return {
+    width,
+    height,
+    data
+  }
 }
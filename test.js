@@ -39,6 +39,549 @@ test('decode 24-bit BMP', function (t) {
   t.is(result.data[3], 255) // A
 })
 
+test('decode 16-bit RGB565 BMP', function (t) {
+  // Create 2x1 16-bit BI_BITFIELDS BMP
+  const header = Buffer.alloc(66)
+
+  // File header
+  header.write('BM', 0)
+  header.writeUInt32LE(70, 2) // file size (66 + 4 byte row)
+  header.writeUInt32LE(66, 10) // data offset
+
+  // DIB header
+  header.writeUInt32LE(40, 14) // header size
+  header.writeInt32LE(2, 18) // width
+  header.writeInt32LE(1, 22) // height
+  header.writeUInt16LE(1, 26) // planes
+  header.writeUInt16LE(16, 28) // bpp
+  header.writeUInt32LE(3, 30) // compression (BI_BITFIELDS)
+
+  // Channel masks
+  header.writeUInt32LE(0xf800, 54) // R
+  header.writeUInt32LE(0x07e0, 58) // G
+  header.writeUInt32LE(0x001f, 62) // B
+
+  // Pixel data (red, blue)
+  const pixels = Buffer.alloc(4)
+  pixels.writeUInt16LE(0xf800, 0)
+  pixels.writeUInt16LE(0x001f, 2)
+
+  const result = bmp.decode(Buffer.concat([header, pixels]))
+
+  t.is(result.width, 2)
+  t.is(result.height, 1)
+  t.alike([...result.data], [255, 0, 0, 255, 0, 0, 255, 255])
+})
+
+test('decode 16-bit RGB555 BMP', function (t) {
+  // Create 1x1 16-bit BI_RGB BMP
+  const header = Buffer.alloc(54)
+
+  // File header
+  header.write('BM', 0)
+  header.writeUInt32LE(58, 2) // file size (54 + 4 padded row)
+  header.writeUInt32LE(54, 10) // data offset
+
+  // DIB header
+  header.writeUInt32LE(40, 14) // header size
+  header.writeInt32LE(1, 18) // width
+  header.writeInt32LE(1, 22) // height
+  header.writeUInt16LE(1, 26) // planes
+  header.writeUInt16LE(16, 28) // bpp
+
+  // Pixel data (R=31, G=16, B=0 + padding)
+  const pixel = Buffer.alloc(4)
+  pixel.writeUInt16LE((31 << 10) | (16 << 5), 0)
+
+  const result = bmp.decode(Buffer.concat([header, pixel]))
+
+  t.alike([...result.data], [255, 132, 0, 255])
+})
+
+test('decode 64-bit BMP', function (t) {
+  // Create 2x1 64-bit BMP
+  const header = Buffer.alloc(54)
+
+  // File header
+  header.write('BM', 0)
+  header.writeUInt32LE(70, 2) // file size (54 + 16 byte row)
+  header.writeUInt32LE(54, 10) // data offset
+
+  // DIB header
+  header.writeUInt32LE(40, 14) // header size
+  header.writeInt32LE(2, 18) // width
+  header.writeInt32LE(1, 22) // height
+  header.writeUInt16LE(1, 26) // planes
+  header.writeUInt16LE(64, 28) // bpp
+
+  // Pixel data (s2.13 fixed point BGRA)
+  const pixels = Buffer.alloc(16)
+  pixels.writeInt16LE(4096, 2) // G = 0.5
+  pixels.writeInt16LE(8192, 4) // R = 1.0
+  pixels.writeInt16LE(8192, 6) // A = 1.0
+  pixels.writeInt16LE(-8192, 8) // B = -1.0
+  pixels.writeInt16LE(16384, 12) // R = 2.0
+  pixels.writeInt16LE(8192, 14) // A = 1.0
+
+  const buffer = Buffer.concat([header, pixels])
+
+  let result = bmp.decode(buffer)
+  t.alike([...result.data], [255, 188, 0, 255, 255, 0, 0, 255])
+
+  result = bmp.decode(buffer, { format: 'float' })
+  t.ok(result.data instanceof Float32Array)
+  t.alike([...result.data], [1, 0.5, 0, 1, 2, 0, -1, 1])
+
+  result = bmp.decode(buffer, { format: 'rgba16' })
+  t.ok(result.data instanceof Uint16Array)
+  t.alike([...result.data], [65535, 32768, 0, 65535, 65535, 0, 0, 65535])
+
+  result = bmp.decode(buffer, { toneMap: true })
+  t.ok(result.data[0] < 255)
+  t.is(result.data[4], 255)
+})
+
+test('decode 24-bit BMP to linear formats', function (t) {
+  const rgba = {
+    width: 1,
+    height: 1,
+    data: Buffer.from([255, 0, 0, 255]) // Red pixel
+  }
+
+  const buffer = bmp.encode(rgba)
+
+  let result = bmp.decode(buffer, { format: 'rgba16' })
+  t.alike([...result.data], [65535, 0, 0, 65535])
+
+  result = bmp.decode(buffer, { format: 'float' })
+  t.alike([...result.data], [1, 0, 0, 1])
+})
+
+test('decode 24-bit BMP to gray', function (t) {
+  const rgba = {
+    width: 4,
+    height: 1,
+    data: Buffer.from([
+      ...[255, 0, 0, 255],
+      ...[0, 255, 0, 255],
+      ...[0, 0, 255, 255],
+      ...[255, 255, 255, 255]
+    ])
+  }
+
+  const buffer = bmp.encode(rgba)
+
+  let result = bmp.decode(buffer, { format: 'gray' })
+  t.is(result.data.byteLength, 4)
+  t.alike([...result.data], [77, 149, 29, 255])
+
+  result = bmp.decode(buffer, { format: 'gray', luma: 'bt709' })
+  t.alike([...result.data], [54, 182, 19, 255])
+})
+
+test('decode 24-bit BMP to I420 and NV12', function (t) {
+  const white = [255, 255, 255, 255]
+  const black = [0, 0, 0, 255]
+  const red = [255, 0, 0, 255]
+
+  const rgba = {
+    width: 3,
+    height: 3,
+    data: Buffer.from([
+      ...[...white, ...white, ...black],
+      ...[...white, ...white, ...black],
+      ...[...red, ...red, ...red]
+    ])
+  }
+
+  const buffer = bmp.encode(rgba)
+  const luma = [235, 235, 16, 235, 235, 16, 82, 82, 82]
+
+  let result = bmp.decode(buffer, { format: 'i420' })
+  t.is(result.data.byteLength, 9 + 4 + 4)
+  t.alike([...result.data], [
+    ...luma,
+    ...[128, 128, 90, 90],
+    ...[128, 128, 240, 240]
+  ])
+
+  result = bmp.decode(buffer, { format: 'nv12' })
+  t.alike([...result.data], [
+    ...luma,
+    ...[128, 128, 128, 128, 90, 240, 90, 240]
+  ])
+})
+
+test('decode 24-bit BMP to tensor', function (t) {
+  const white = [255, 255, 255, 255]
+  const black = [0, 0, 0, 255]
+  const red = [255, 0, 0, 255]
+  const blue = [0, 0, 255, 255]
+
+  const rgba = {
+    width: 4,
+    height: 2,
+    data: Buffer.from([
+      ...[...white, ...black, ...red, ...red],
+      ...[...white, ...white, ...red, ...blue]
+    ])
+  }
+
+  const buffer = bmp.encode(rgba)
+
+  let result = bmp.decode(buffer, {
+    format: 'tensor',
+    crop: { x: 2, y: 1, width: 2, height: 1 }
+  })
+  t.is(result.width, 2)
+  t.is(result.height, 1)
+  t.ok(result.data instanceof Float32Array)
+  t.alike([...result.data], [1, 0, 0, 0, 0, 1])
+
+  // Each element averages a 2x2 block
+  result = bmp.decode(buffer, {
+    format: 'tensor',
+    layout: 'hwc',
+    dtype: 'float16',
+    channels: 'bgr',
+    mean: [0.5, 0.5, 0.5],
+    std: [0.5, 0.5, 0.5],
+    resize: { width: 2, height: 1 }
+  })
+  t.ok(result.data instanceof Uint16Array)
+  t.alike(
+    [...result.data],
+    [0x3800, 0x3800, 0x3800, 0xb800, 0xbc00, 0x3800]
+  )
+
+  t.exception(() => {
+    bmp.decode(buffer, {
+      format: 'tensor',
+      crop: { x: 2, y: 0, width: 4, height: 2 }
+    })
+  })
+
+  t.exception(() => bmp.decode(buffer, { format: 'tensor', crop: { x: 0 } }))
+
+  t.exception(() => {
+    bmp.decode(buffer, {
+      format: 'tensor',
+      crop: { x: 0, y: 0, width: 2, height: 2 },
+      resize: { width: 3, height: 1 }
+    })
+  })
+})
+
+test('decode and encode with rotation and flips', function (t) {
+  // 3x2 image with red channel values 1 to 6
+  const rgba = {
+    width: 3,
+    height: 2,
+    data: Buffer.from([1, 2, 3, 4, 5, 6].flatMap((r) => [r, 0, 0, 255]))
+  }
+
+  const reds = (image) => [...image.data].filter((_, i) => i % 4 === 0)
+
+  const buffer = bmp.encode(rgba)
+
+  let result = bmp.decode(buffer, { rotate: 90 })
+  t.is(result.width, 2)
+  t.is(result.height, 3)
+  t.alike(reds(result), [4, 1, 5, 2, 6, 3])
+
+  result = bmp.decode(buffer, { rotate: 90, flipX: true })
+  t.alike(reds(result), [1, 4, 2, 5, 3, 6])
+
+  result = bmp.decode(buffer, { rotate: 180 })
+  t.alike(reds(result), [6, 5, 4, 3, 2, 1])
+
+  result = bmp.decode(buffer, { flipY: true })
+  t.alike(reds(result), [4, 5, 6, 1, 2, 3])
+
+  result = bmp.decode(bmp.encode(rgba, { rotate: 270 }))
+  t.is(result.width, 2)
+  t.alike(reds(result), [3, 6, 2, 5, 1, 4])
+
+  result = bmp.decode(bmp.encode(rgba, { rotate: 90 }), { rotate: 270 })
+  t.alike([...result.data], [...rgba.data])
+})
+
+test('decode BMP with color adjustments', function (t) {
+  const rgba = {
+    width: 1,
+    height: 1,
+    data: Buffer.from([10, 20, 30, 255])
+  }
+
+  const buffer = bmp.encode(rgba)
+
+  const identity = Array.from({ length: 256 }, (_, i) => i)
+  const invert = identity.map((i) => 255 - i)
+
+  let result = bmp.decode(buffer, { lut: [invert, identity, identity] })
+  t.alike([...result.data], [245, 20, 30, 255])
+
+  // Swap red and blue after the lookup
+  result = bmp.decode(buffer, {
+    lut: [invert, identity, identity],
+    matrix: [0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 0]
+  })
+  t.alike([...result.data], [30, 20, 245, 255])
+
+  // Brighten by an offset of 0.1
+  result = bmp.decode(buffer, {
+    format: 'rgb',
+    matrix: [1, 0, 0, 0.1, 0, 1, 0, 0.1, 0, 0, 1, 0.1]
+  })
+  t.alike([...result.data], [36, 46, 56])
+})
+
+test('decode OS/2 BITMAPCOREHEADER BMP', function (t) {
+  // 2x1 4-bit BMP with a 3-byte per entry color table
+  const buffer = Buffer.alloc(14 + 12 + 16 * 3 + 4)
+
+  // File header
+  buffer.write('BM', 0)
+  buffer.writeUInt32LE(buffer.byteLength, 2) // file size
+  buffer.writeUInt32LE(14 + 12 + 16 * 3, 10) // data offset
+
+  // DIB header
+  buffer.writeUInt32LE(12, 14) // header size
+  buffer.writeUInt16LE(2, 18) // width
+  buffer.writeUInt16LE(1, 20) // height
+  buffer.writeUInt16LE(1, 22) // planes
+  buffer.writeUInt16LE(4, 24) // bpp
+
+  // Color table (BGR)
+  buffer[26 + 1 * 3 + 2] = 255 // 1 = red
+  buffer[26 + 2 * 3 + 0] = 255 // 2 = blue
+
+  // Pixel data
+  buffer[74] = 0x12
+
+  const result = bmp.decode(buffer)
+
+  t.is(result.width, 2)
+  t.is(result.height, 1)
+  t.alike([...result.data], [255, 0, 0, 255, 0, 0, 255, 255])
+})
+
+test('decode OS/2 2.x BMP', function (t) {
+  // 1x1 24-bit BMP with a 64-byte header
+  const buffer = Buffer.alloc(14 + 64 + 4)
+
+  // File header
+  buffer.write('BM', 0)
+  buffer.writeUInt32LE(buffer.byteLength, 2) // file size
+  buffer.writeUInt32LE(14 + 64, 10) // data offset
+
+  // DIB header
+  buffer.writeUInt32LE(64, 14) // header size
+  buffer.writeInt32LE(1, 18) // width
+  buffer.writeInt32LE(1, 22) // height
+  buffer.writeUInt16LE(1, 26) // planes
+  buffer.writeUInt16LE(24, 28) // bpp
+
+  // Pixel data (BGR + padding)
+  buffer[78] = 255
+
+  const result = bmp.decode(buffer)
+
+  t.alike([...result.data], [0, 0, 255, 255])
+})
+
+test('decode headerless DIB', function (t) {
+  // 1x1 8-bit DIB at an offset within a larger buffer
+  const buffer = Buffer.alloc(8 + 40 + 2 * 4 + 4)
+  buffer.writeUInt32LE(40, 8) // header size
+  buffer.writeInt32LE(1, 12) // width
+  buffer.writeInt32LE(1, 16) // height
+  buffer.writeUInt16LE(1, 20) // planes
+  buffer.writeUInt16LE(8, 22) // bpp
+  buffer.writeUInt32LE(2, 40) // colors used
+  buffer.writeUInt32LE(0x00ff00, 52) // palette entry 1 (green)
+  buffer[56] = 1 // pixel
+
+  const result = bmp.decodeDIB(buffer, { offset: 8 })
+
+  t.is(result.width, 1)
+  t.is(result.height, 1)
+  t.alike([...result.data], [0, 255, 0, 255])
+
+  t.exception(() => bmp.decodeDIB(buffer, { offset: -1 }))
+  t.exception(() => bmp.decodeDIB(buffer, { offset: '8' }))
+})
+
+test('decode headerless 24-bit DIB with color table', function (t) {
+  // 1x1 24-bit DIB whose pixels follow an optional 2-entry color table
+  const buffer = Buffer.alloc(40 + 2 * 4 + 4)
+  buffer.writeUInt32LE(40, 0) // header size
+  buffer.writeInt32LE(1, 4) // width
+  buffer.writeInt32LE(1, 8) // height
+  buffer.writeUInt16LE(1, 12) // planes
+  buffer.writeUInt16LE(24, 14) // bpp
+  buffer.writeUInt32LE(2, 32) // colors used
+  buffer[50] = 255 // pixel (BGR, red)
+
+  const result = bmp.decodeDIB(buffer)
+
+  t.alike([...result.data], [255, 0, 0, 255])
+})
+
+test('decode BMP with embedded PNG', function (t) {
+  const png = Buffer.from('\x89PNG\r\n\x1a\n', 'latin1')
+
+  const buffer = Buffer.alloc(14 + 40 + png.byteLength + 2)
+  buffer.write('BM', 0)
+  buffer.writeUInt32LE(14 + 40, 10) // data offset
+  buffer.writeUInt32LE(40, 14) // header size
+  buffer.writeInt32LE(3, 18) // width
+  buffer.writeInt32LE(2, 22) // height
+  buffer.writeUInt16LE(1, 26) // planes
+  buffer.writeUInt32LE(5, 30) // compression (BI_PNG)
+  buffer.writeUInt32LE(png.byteLength, 34) // image size
+  png.copy(buffer, 14 + 40)
+
+  const result = bmp.decode(buffer)
+
+  t.is(result.embedded, 'png')
+  t.is(result.width, 3)
+  t.is(result.height, 2)
+  t.alike([...result.data], [...png])
+  t.is(result.data.buffer, buffer.buffer, 'shares memory')
+
+  const icon = Buffer.alloc(6 + 16)
+  icon.writeUInt16LE(1, 2) // type (icon)
+  icon.writeUInt16LE(1, 4) // count
+  icon.writeUInt32LE(png.byteLength, 14) // size
+  icon.writeUInt32LE(icon.byteLength, 18) // offset
+
+  const entry = bmp.decodeIcon(Buffer.concat([icon, png]))
+
+  t.is(entry.embedded, 'png')
+  t.is(entry.width, 256)
+  t.alike([...entry.data], [...png])
+})
+
+test('decode RLE8 and RLE4 BMP', function (t) {
+  // 4x2 images with an encoded run, an absolute run and a delta
+  const rle8 = Buffer.from([
+    ...[3, 1, 0, 0], // bottom row: run of 3
+    ...[0, 2, 3, 0], // delta to the last pixel of the top row
+    ...[1, 2, 0, 1] // single pixel and end of bitmap
+  ])
+
+  const rle4 = Buffer.from([
+    ...[4, 0x12, 0, 0], // bottom row: alternating run of 4
+    ...[0, 3, 0x21, 0x20, 0, 1] // absolute run of 3 and end of bitmap
+  ])
+
+  for (const [compression, bpp, pixels] of [
+    [1, 8, rle8],
+    [2, 4, rle4]
+  ]) {
+    const buffer = Buffer.alloc(14 + 40 + 3 * 4 + pixels.byteLength)
+    buffer.write('BM', 0)
+    buffer.writeUInt32LE(14 + 40 + 3 * 4, 10) // data offset
+    buffer.writeUInt32LE(40, 14) // header size
+    buffer.writeInt32LE(4, 18) // width
+    buffer.writeInt32LE(2, 22) // height
+    buffer.writeUInt16LE(1, 26) // planes
+    buffer.writeUInt16LE(bpp, 28) // bpp
+    buffer.writeUInt32LE(compression, 30) // compression
+    buffer.writeUInt32LE(3, 46) // colors used
+    buffer.writeUInt32LE(0xff0000, 58) // palette entry 1 (red)
+    buffer.writeUInt32LE(0x0000ff, 62) // palette entry 2 (blue)
+    pixels.copy(buffer, 14 + 40 + 3 * 4)
+
+    const result = bmp.decode(buffer)
+    const indices = []
+
+    for (let i = 0; i < 8; i++) {
+      indices.push(result.data[i * 4] ? 1 : result.data[i * 4 + 2] ? 2 : 0)
+    }
+
+    if (bpp === 8) t.alike(indices, [0, 0, 0, 2, 1, 1, 1, 0])
+    else t.alike(indices, [2, 1, 2, 0, 1, 2, 1, 2])
+
+    // Oversized images are rejected before allocating
+    buffer.writeInt32LE(40, 18) // width
+    buffer.writeInt32LE(16711935, 22) // height
+    t.exception(() => bmp.decode(buffer))
+  }
+
+  // A stream of just end of bitmap leaves every pixel at the first entry
+  const buffer = Buffer.alloc(14 + 40 + 4 + 2)
+  buffer.write('BM', 0)
+  buffer.writeUInt32LE(14 + 40 + 4, 10) // data offset
+  buffer.writeUInt32LE(40, 14) // header size
+  buffer.writeInt32LE(1000, 18) // width
+  buffer.writeInt32LE(1000, 22) // height
+  buffer.writeUInt16LE(1, 26) // planes
+  buffer.writeUInt16LE(4, 28) // bpp
+  buffer.writeUInt32LE(2, 30) // compression
+  buffer.writeUInt32LE(1, 46) // colors used
+  buffer.writeUInt16LE(0x0100, 58) // end of bitmap
+
+  const result = bmp.decode(buffer)
+  t.is(result.width, 1000)
+  t.is(result.data[4 * 999999 + 3], 255)
+})
+
+test('decode .ico', function (t) {
+  // 2x2 24-bit entry with an AND mask making the top-left pixel transparent
+  const small = Buffer.alloc(40 + 2 * 8 + 2 * 4)
+  small.writeUInt32LE(40, 0) // header size
+  small.writeInt32LE(2, 4) // width
+  small.writeInt32LE(4, 8) // height (doubled)
+  small.writeUInt16LE(1, 12) // planes
+  small.writeUInt16LE(24, 14) // bpp
+  small.fill(255, 40, 56) // white pixels
+  small[60] = 0x80 // AND mask, top row (stored last)
+
+  // 4x4 32-bit entry
+  const large = Buffer.alloc(40 + 4 * 16 + 4 * 4)
+  large.writeUInt32LE(40, 0) // header size
+  large.writeInt32LE(4, 4) // width
+  large.writeInt32LE(8, 8) // height (doubled)
+  large.writeUInt16LE(1, 12) // planes
+  large.writeUInt16LE(32, 14) // bpp
+  large.fill(0x80, 40, 104) // translucent gray pixels
+
+  const dir = Buffer.alloc(6 + 2 * 16)
+  dir.writeUInt16LE(1, 2) // type (icon)
+  dir.writeUInt16LE(2, 4) // count
+
+  dir[6] = 2 // width
+  dir[7] = 2 // height
+  dir.writeUInt16LE(24, 12) // bpp
+  dir.writeUInt32LE(small.byteLength, 14) // size
+  dir.writeUInt32LE(dir.byteLength, 18) // offset
+
+  dir[22] = 4 // width
+  dir[23] = 4 // height
+  dir.writeUInt16LE(32, 28) // bpp
+  dir.writeUInt32LE(large.byteLength, 30) // size
+  dir.writeUInt32LE(dir.byteLength + small.byteLength, 34) // offset
+
+  const buffer = Buffer.concat([dir, small, large])
+
+  let result = bmp.decodeIcon(buffer)
+  t.is(result.width, 4)
+  t.is(result.height, 4)
+  t.alike([...result.data.subarray(0, 4)], [0x80, 0x80, 0x80, 0x80])
+
+  result = bmp.decodeIcon(buffer, { size: 3 })
+  t.is(result.width, 4, 'prefers larger on ties')
+
+  result = bmp.decodeIcon(buffer, { size: 1 })
+  t.is(result.width, 2)
+  t.is(result.height, 2)
+  t.is(result.data[3], 0) // masked
+  t.is(result.data[7], 255)
+  t.is(result.data[15], 255)
+})
+
 test('encode .bmp', (t) => {
   const image = require('./test/fixtures/sample.bmp', {
     with: { type: 'binary' }
@@ -71,6 +614,572 @@ test('encode RGBA to BMP', function (t) {
   t.is(result.data[2], 0) // B
 })
 
-test('encodeAnimated throws', function (t) {
-  t.exception(() => bmp.encodeAnimated())
+test('encode RGBA to top-down BMP', function (t) {
+  const top = [255, 0, 0, 255, 0, 255, 0, 128]
+  const bottom = [0, 0, 255, 255, 1, 2, 3, 64]
+
+  const image = { width: 2, height: 2, data: Buffer.from([...top, ...bottom]) }
+
+  for (const bpp of [24, 32]) {
+    const buffer = bmp.encode(image, { bpp, topDown: true, resolution: 300 })
+
+    t.is(buffer.readInt32LE(22), -2) // height (top-down)
+    t.is(buffer.readInt32LE(38), 11811) // 300 DPI
+    t.is(buffer.readInt32LE(42), 11811)
+
+    // Top row first
+    const offset = buffer.readUInt32LE(10)
+    t.alike([...buffer.subarray(offset, offset + 3)], [0, 0, 255])
+
+    const expected = [...top, ...bottom].map((v, i) =>
+      bpp === 24 && i % 4 === 3 ? 255 : v
+    )
+
+    t.alike([...bmp.decode(buffer).data], expected)
+  }
+})
+
+test('encode RGBA region of a larger image', function (t) {
+  // 2x2 region at (1, 1) of a 4x4 canvas
+  const canvas = Buffer.alloc(4 * 4 * 4)
+  for (let i = 0; i < canvas.byteLength; i++) canvas[i] = (i * 37) & 0xff
+
+  const data = Buffer.alloc(2 * 2 * 4)
+  canvas.copy(data, 0, 20, 28)
+  canvas.copy(data, 8, 36, 44)
+
+  const region = { width: 2, height: 2, data: canvas, stride: 16, offset: 20 }
+  const packed = { width: 2, height: 2, data }
+
+  for (const opts of [{ bpp: 24 }, { bpp: 8 }, { optimize: true }]) {
+    t.alike(bmp.encode(region, opts), bmp.encode(packed, opts))
+  }
+
+  t.alike(bmp.encodeIcon(region), bmp.encodeIcon(packed))
+
+  t.exception(() => bmp.encode({ ...region, stride: 4 }))
+  t.exception(() => bmp.encode({ ...region, offset: 48 }))
+  t.exception(() => bmp.encode({ ...region, height: 5, stride: 2 ** 62 }))
+})
+
+test('encode from other input formats', function (t) {
+  const pixels = [
+    [255, 0, 0, 255],
+    [0, 255, 0, 128],
+    [0, 0, 255, 0],
+    [10, 10, 10, 255],
+    [128, 128, 128, 255],
+    [250, 250, 250, 255]
+  ]
+
+  const image = (fn) => ({
+    width: 3,
+    height: 2,
+    data: Buffer.from(pixels.flatMap(fn))
+  })
+
+  const rgba = image((px) => px)
+  const opaque = image(([r, g, b]) => [r, g, b, 255])
+
+  const inputs = {
+    rgb: image(([r, g, b]) => [r, g, b]),
+    bgra: image(([r, g, b, a]) => [b, g, r, a]),
+    bgrx: image(([r, g, b]) => [b, g, r, 0]),
+    rgba16: {
+      ...rgba,
+      data: bmp.decode(bmp.encode(rgba, { bpp: 32 }), { format: 'rgba16' }).data
+    }
+  }
+
+  for (const [inputFormat, input] of Object.entries(inputs)) {
+    const alpha = inputFormat === 'bgra' || inputFormat === 'rgba16'
+
+    for (const bpp of [8, 16, 24, 32]) {
+      const expected = bmp.encode(alpha ? rgba : opaque, { bpp })
+      const actual = bmp.encode(input, { bpp, inputFormat })
+
+      t.alike(
+        bmp.decode(actual).data,
+        bmp.decode(expected).data,
+        `${inputFormat} to ${bpp}-bit`
+      )
+    }
+  }
+
+  // Gray input is stored with a gray ramp
+  const gray = Buffer.from([0, 64, 128, 192, 255, 7])
+  const buffer = bmp.encode(
+    { width: 3, height: 2, data: gray },
+    { bpp: 8, inputFormat: 'gray' }
+  )
+
+  t.is(buffer.readUInt32LE(46), 256) // colors used
+  t.alike(
+    [...bmp.decode(buffer).data].filter((v, i) => i % 4 === 0),
+    [...gray]
+  )
+})
+
+test('encode throws on unsupported options', function (t) {
+  const rgba = { width: 2, height: 2, data: Buffer.alloc(16, 200) }
+
+  t.exception(() => bmp.encode(rgba, { bpp: 12 }))
+  t.exception(() => bmp.encode(rgba, { bpp: '32' }))
+  t.exception(() => bmp.encode(rgba, { optimize: 'yes' }))
+  t.exception(() => bmp.encode(rgba, { topDown: 1 }))
+  t.exception(() => bmp.encode(rgba, { premultiplied: null }))
+  t.exception(() => bmp.encode(rgba, { flipX: 1 }))
+  t.exception(() => bmp.encode(rgba, { flipY: 'true' }))
+  t.exception(() => bmp.encode(rgba, { bpp: 8, palette: 'mono' }))
+})
+
+test('encode RGBA to 16-bit BMP', function (t) {
+  const rgba = {
+    width: 2,
+    height: 1,
+    data: Buffer.from([255, 0, 0, 255, 0, 255, 0, 255]) // Red, green
+  }
+
+  const buffer = bmp.encode(rgba, { bpp: 16 })
+
+  t.is(buffer.readUInt16LE(28), 16) // bpp
+  t.is(buffer.readUInt32LE(30), 3) // compression (BI_BITFIELDS)
+  t.is(buffer.readUInt32LE(54), 0xf800) // R mask
+  t.is(buffer.readUInt32LE(58), 0x07e0) // G mask
+  t.is(buffer.readUInt32LE(62), 0x001f) // B mask
+
+  const result = bmp.decode(buffer)
+  t.alike([...result.data], [...rgba.data])
+
+  const rgb555 = bmp.encode(rgba, { bpp: 16, mode: '555' })
+  t.is(rgb555.readUInt32LE(54), 0x7c00) // R mask
+  t.alike([...bmp.decode(rgb555).data], [...rgba.data])
+})
+
+test('encode RGBA to dithered 16-bit BMP', function (t) {
+  const width = 16
+  const height = 16
+  const data = Buffer.alloc(width * height * 4)
+
+  for (let i = 0; i < data.byteLength; i += 4) {
+    data[i] = data[i + 1] = data[i + 2] = 100 // Between two 5-bit levels
+    data[i + 3] = 255
+  }
+
+  for (const dither of ['ordered', 'floyd-steinberg']) {
+    const result = bmp.decode(
+      bmp.encode({ width, height, data }, { bpp: 16, dither })
+    )
+
+    let sum = 0
+    for (let i = 0; i < result.data.byteLength; i += 4) sum += result.data[i]
+
+    t.ok(Math.abs(sum / (width * height) - 100) < 2, dither)
+  }
+})
+
+test('encode RGBA to 32-bit BMP', function (t) {
+  const rgba = {
+    width: 2,
+    height: 1,
+    data: Buffer.from([255, 0, 0, 128, 0, 0, 255, 0]) // Red, blue
+  }
+
+  const buffer = bmp.encode(rgba, { bpp: 32 })
+
+  t.is(buffer.byteLength, 14 + 124 + 8)
+  t.is(buffer.readUInt32LE(14), 124) // header size (BITMAPV5HEADER)
+  t.is(buffer.readUInt16LE(28), 32) // bpp
+  t.is(buffer.readUInt32LE(30), 3) // compression (BI_BITFIELDS)
+  t.is(buffer.readUInt32LE(66), 0xff000000) // A mask
+
+  const result = bmp.decode(buffer)
+  t.alike([...result.data], [...rgba.data])
+})
+
+test('premultiplied alpha on decode and encode', function (t) {
+  const rgba = {
+    width: 3,
+    height: 1,
+    data: Buffer.from([
+      ...[200, 100, 50, 128],
+      ...[255, 0, 0, 0],
+      ...[10, 20, 30, 255]
+    ])
+  }
+
+  const premultiplied = [
+    ...[100, 50, 25, 128],
+    ...[0, 0, 0, 0],
+    ...[10, 20, 30, 255]
+  ]
+
+  let result = bmp.decode(bmp.encode(rgba, { bpp: 32 }), {
+    premultiplied: true
+  })
+  t.alike([...result.data], premultiplied)
+
+  const buffer = bmp.encode(
+    { ...rgba, data: Buffer.from(premultiplied) },
+    { bpp: 32, premultiplied: true }
+  )
+
+  result = bmp.decode(buffer)
+  t.alike(
+    [...result.data],
+    [...[199, 100, 50, 128], ...[0, 0, 0, 0], ...[10, 20, 30, 255]]
+  )
+})
+
+test('decode 32-bit BMP over a background', function (t) {
+  const rgba = {
+    width: 3,
+    height: 1,
+    data: Buffer.from([
+      ...[255, 0, 0, 128],
+      ...[0, 0, 255, 0],
+      ...[10, 20, 30, 255]
+    ])
+  }
+
+  const buffer = bmp.encode(rgba, { bpp: 32 })
+
+  let result = bmp.decode(buffer, { format: 'rgb' })
+  t.alike([...result.data], [255, 0, 0, 0, 0, 255, 10, 20, 30])
+
+  const background = [255, 255, 255]
+
+  result = bmp.decode(buffer, { format: 'rgb', background })
+  t.is(result.data.byteLength, 9)
+  t.alike([...result.data], [255, 127, 127, 255, 255, 255, 10, 20, 30])
+
+  result = bmp.decode(buffer, { background })
+  t.alike(
+    [...result.data],
+    [...[255, 127, 127, 255], ...[255, 255, 255, 255], ...[10, 20, 30, 255]]
+  )
+})
+
+test('decode BMP with a color key', function (t) {
+  const magenta = [255, 0, 255, 255]
+
+  const rgba = {
+    width: 3,
+    height: 1,
+    data: Buffer.from([...magenta, ...[250, 4, 255, 255], ...[10, 20, 30, 255]])
+  }
+
+  const buffer = bmp.encode(rgba)
+
+  let result = bmp.decode(buffer, { colorKey: [255, 0, 255] })
+  t.alike(
+    [...result.data],
+    [...[255, 0, 255, 0], ...[250, 4, 255, 255], ...[10, 20, 30, 255]]
+  )
+
+  result = bmp.decode(buffer, {
+    format: 'rgb',
+    colorKey: [255, 0, 255],
+    colorKeyTolerance: 5,
+    background: [0, 0, 0]
+  })
+  t.alike([...result.data], [0, 0, 0, 0, 0, 0, 10, 20, 30])
+})
+
+test('encode RGBA to indexed BMP', function (t) {
+  const rgba = {
+    width: 3,
+    height: 2,
+    data: Buffer.from([
+      255, 0, 0, 255, 0, 255, 0, 255, 0, 0, 255, 255, 0, 0, 255, 255, 255, 0,
+      0, 255, 0, 255, 0, 255
+    ])
+  }
+
+  for (const bpp of [8, 4, 1]) {
+    const buffer = bmp.encode(rgba, { bpp })
+
+    t.is(buffer.readUInt16LE(28), bpp) // bpp
+    t.is(buffer.readUInt32LE(46), bpp === 1 ? 2 : 3) // colors used
+
+    if (bpp === 1) continue
+
+    const result = bmp.decode(buffer)
+    t.alike([...result.data], [...rgba.data], `${bpp}-bit`)
+  }
+})
+
+test('encode RGBA to quantized 8-bit BMP', function (t) {
+  const width = 64
+  const height = 64
+  const data = Buffer.alloc(width * height * 4)
+
+  for (let y = 0; y < height; y++) {
+    for (let x = 0; x < width; x++) {
+      const i = (y * width + x) * 4
+      data[i] = x * 4
+      data[i + 1] = y * 4
+      data[i + 2] = 128
+      data[i + 3] = 255
+    }
+  }
+
+  const buffer = bmp.encode({ width, height, data }, { bpp: 8 })
+
+  t.is(buffer.readUInt32LE(46), 256) // colors used
+  t.ok(buffer.byteLength < width * height * 3)
+
+  const result = bmp.decode(buffer)
+
+  let error = 0
+  for (let i = 0; i < data.byteLength; i++) {
+    error = Math.max(error, Math.abs(result.data[i] - data[i]))
+  }
+
+  t.ok(error < 16)
+})
+
+test('encode RGBA with optimize', function (t) {
+  const cases = [
+    // Flat two-color image, run-length encoded
+    [64, 8, (x) => (x < 32 ? [255, 0, 0, 255] : [0, 0, 255, 255]), 4, 2],
+    // Noisy 16-color image, packed to 4 bits
+    [16, 16, (x, y) => [((x * 7 + y * 3) % 16) * 17, 0, 0, 255], 4, 0],
+    // Runs of 100 colors, run-length encoded
+    [100, 10, (x, y) => [y * 25, (x >> 3) * 16, 0, 255], 8, 1],
+    // RGB565 gradient
+    [64, 64, (x, y) => [((x >> 1) * 33) >> 2, (y * 65) >> 4, 0, 255], 16, 3],
+    // Translucent pixels
+    [4, 4, (x) => [0, 0, 0, x * 64], 32, 3],
+    // Everything else
+    [64, 64, (x, y) => [x * 4, y * 4, x ^ y, 255], 24, 0]
+  ]
+
+  for (const [width, height, pixel, bpp, compression] of cases) {
+    const data = Buffer.alloc(width * height * 4)
+
+    for (let y = 0; y < height; y++) {
+      for (let x = 0; x < width; x++) {
+        data.set(pixel(x, y), (y * width + x) * 4)
+      }
+    }
+
+    const buffer = bmp.encode({ width, height, data }, { optimize: true })
+
+    t.is(buffer.readUInt16LE(28), bpp, `${bpp}-bit`)
+    t.is(buffer.readUInt32LE(30), compression)
+    t.alike(bmp.decode(buffer).data, data, 'lossless')
+  }
+
+  // Small images where the color table outweighs the pixels it saves
+  const sample = bmp.decode(
+    require('./test/fixtures/sample.bmp', { with: { type: 'binary' } })
+  )
+  const pixel = { width: 1, height: 1, data: Buffer.from([1, 2, 3, 255]) }
+
+  for (const image of [sample, pixel]) {
+    const buffer = bmp.encode(image, { optimize: true })
+
+    t.ok(buffer.byteLength <= bmp.encode(image).byteLength, 'not larger')
+    t.alike(bmp.decode(buffer).data, image.data, 'lossless')
+  }
+})
+
+test('encode RGBA to monochrome BMP', function (t) {
+  const width = 10
+  const height = 2
+  const data = Buffer.alloc(width * height * 4, 255)
+
+  for (let i = 0; i < data.byteLength; i += 4) {
+    const x = (i / 4) % width
+    data[i] = data[i + 1] = data[i + 2] = x < 5 ? 40 : 90 // Dark, mid
+  }
+
+  let buffer = bmp.encode({ width, height, data }, { bpp: 1, palette: 'mono' })
+
+  t.is(buffer.readUInt16LE(28), 1) // bpp
+  t.is(buffer.readUInt32LE(46), 2) // colors used
+  t.is(buffer.readUInt32LE(54), 0x000000) // black
+  t.is(buffer.readUInt32LE(58), 0xffffff) // white
+
+  let result = bmp.decode(buffer)
+  t.is(result.data[5 * 4], 0, 'below fixed threshold')
+
+  buffer = bmp.encode(
+    { width, height, data },
+    { bpp: 1, palette: 'mono', threshold: 'otsu' }
+  )
+
+  result = bmp.decode(buffer)
+  t.is(result.data[0], 0, 'dark class')
+  t.is(result.data[5 * 4], 255, 'mid class')
+})
+
+test('encode RGBA to dithered monochrome BMP', function (t) {
+  const width = 32
+  const height = 32
+  const data = Buffer.alloc(width * height * 4, 255)
+
+  for (let i = 0; i < data.byteLength; i += 4) {
+    data[i] = data[i + 1] = data[i + 2] = 128
+  }
+
+  for (const dither of ['ordered', 'floyd-steinberg', 'atkinson']) {
+    const result = bmp.decode(
+      bmp.encode({ width, height, data }, { bpp: 1, palette: 'mono', dither })
+    )
+
+    let white = 0
+    for (let i = 0; i < result.data.byteLength; i += 4) {
+      if (result.data[i] === 255) white++
+    }
+
+    t.ok(Math.abs(white / (width * height) - 0.5) < 0.05, dither)
+  }
+})
+
+test('encode RGBA to .ico', function (t) {
+  const width = 64
+  const height = 64
+  const data = Buffer.alloc(width * height * 4)
+
+  for (let i = 0; i < data.byteLength; i += 4) {
+    data[i] = 255 // Red
+    data[i + 3] = 255
+  }
+
+  const buffer = bmp.encodeIcon({ width, height, data }, { sizes: [16, 48] })
+
+  t.is(buffer.readUInt16LE(2), 1) // type (icon)
+  t.is(buffer.readUInt16LE(4), 2) // count
+  t.is(buffer[6], 16) // width
+  t.is(buffer[22], 48) // width
+
+  for (const size of [16, 48]) {
+    const result = bmp.decodeIcon(buffer, { size })
+
+    t.is(result.width, size)
+    t.is(result.height, size)
+    t.alike([...result.data.subarray(0, 4)], [255, 0, 0, 255])
+  }
+
+  const image = { width, height, data }
+
+  t.exception(() => bmp.encodeIcon(image, { sizes: 16 }))
+  t.exception(() => bmp.encodeIcon(image, { sizes: [] }))
+  t.exception(() => bmp.encodeIcon(image, { sizes: ['16'] }))
+  t.exception(() => bmp.encodeIcon(image, { sizes: [512] }))
+})
+
+test('encode RGBA frames to .avi', function (t) {
+  const frames = [
+    { width: 2, height: 1, data: Buffer.from([255, 0, 0, 255, 0, 0, 0, 255]) },
+    { width: 2, height: 1, data: Buffer.from([0, 255, 0, 255, 0, 0, 0, 255]) }
+  ]
+
+  const buffer = bmp.encodeAnimated(frames, { fps: 25 })
+
+  t.is(buffer.toString('latin1', 0, 4), 'RIFF')
+  t.is(buffer.readUInt32LE(4), buffer.byteLength - 8)
+  t.is(buffer.toString('latin1', 8, 12), 'AVI ')
+  t.is(buffer.readUInt32LE(32), 40000) // microseconds per frame
+  t.is(buffer.readUInt32LE(48), 2) // total frames
+
+  const movi = buffer.indexOf('movi')
+  const idx1 = buffer.indexOf('idx1')
+
+  for (let i = 0; i < frames.length; i++) {
+    const entry = idx1 + 8 + i * 16
+    t.is(buffer.toString('latin1', entry, entry + 4), '00db')
+
+    const offset = movi + buffer.readUInt32LE(entry + 8)
+    t.is(buffer.toString('latin1', offset, offset + 4), '00db')
+    t.is(buffer.readUInt32LE(offset + 4), 8) // 24-bit row padded to 4 bytes
+
+    const pixel = buffer.subarray(offset + 8, offset + 11)
+    t.alike([...pixel], [...frames[i].data.subarray(0, 3)].reverse())
+  }
+})
+
+test('encode RGBA frames to .ani', function (t) {
+  const frames = [
+    { width: 2, height: 2, data: Buffer.alloc(16, 255) },
+    { width: 2, height: 2, data: Buffer.alloc(16, 0) }
+  ]
+
+  const buffer = bmp.encodeAnimated(frames, { container: 'ani', fps: 10 })
+
+  t.is(buffer.toString('latin1', 8, 12), 'ACON')
+  t.is(buffer.readUInt32LE(24), 2) // frames
+  t.is(buffer.readUInt32LE(48), 6) // rate in jiffies
+
+  let offset = buffer.indexOf('icon')
+
+  for (const frame of frames) {
+    const size = buffer.readUInt32LE(offset + 4)
+    const icon = buffer.subarray(offset + 8, offset + 8 + size)
+    const result = bmp.decodeIcon(icon)
+
+    t.is(result.width, 2)
+    t.alike([...result.data], [...frame.data])
+
+    offset += 8 + size
+  }
+})
+
+test('encodeAnimated throws without frames', function (t) {
+  t.exception(() => bmp.encodeAnimated([]))
+})
+
+test('encodeAnimated throws on unsupported options', function (t) {
+  const frames = [{ width: 1, height: 1, data: Buffer.alloc(4, 255) }]
+
+  t.exception(() => bmp.encodeAnimated(frames, { fps: '30' }))
+  t.exception(() => bmp.encodeAnimated(frames, { fps: 0 }))
+  t.exception(() => bmp.encodeAnimated(frames, { bpp: '32' }))
+  t.exception(() => bmp.encodeAnimated(frames, { bpp: 16 }))
+})
+
+test('transcode 32-bit BMP to 24-bit', function (t) {
+  const top = [255, 0, 0, 255, 0, 255, 0, 128, 0, 0, 255, 0]
+  const bottom = [1, 2, 3, 255, 4, 5, 6, 255, 7, 8, 9, 255]
+
+  const image = { width: 3, height: 2, data: Buffer.from([...top, ...bottom]) }
+
+  const buffer = bmp.transcode(bmp.encode(image, { bpp: 32 }))
+
+  t.is(buffer.readUInt16LE(28), 24) // bpp
+  t.is(buffer.readInt32LE(22), 2) // height (bottom-up)
+
+  const result = bmp.decode(buffer)
+
+  t.is(result.width, 3)
+  t.alike(
+    [...result.data],
+    [255, 0, 0, 255, 0, 255, 0, 255, 0, 0, 255, 255, ...bottom],
+    'drops alpha'
+  )
+})
+
+test('transcode indexed BMP to top-down 32-bit', function (t) {
+  const top = [255, 0, 0, 255, 0, 255, 0, 255]
+  const bottom = [0, 0, 255, 255, 255, 0, 0, 255]
+
+  const image = { width: 2, height: 2, data: Buffer.from([...top, ...bottom]) }
+
+  const buffer = bmp.transcode(bmp.encode(image, { bpp: 4 }), {
+    bpp: 32,
+    topDown: true
+  })
+
+  t.is(buffer.readUInt16LE(28), 32) // bpp
+  t.is(buffer.readInt32LE(22), -2) // height (top-down)
+
+  const offset = buffer.readUInt32LE(10)
+  t.alike([...buffer.subarray(offset, offset + 4)], [0, 0, 255, 255])
+
+  t.alike([...bmp.decode(buffer).data], [...top, ...bottom])
+
+  t.exception(() => bmp.transcode(buffer, { bpp: '32' }))
+  t.exception(() => bmp.transcode(buffer, { topDown: 1 }))
 })